@@ -15,6 +15,8 @@ in rec {
       pkgs.libressl_3_9
       pkgs.pcre-cpp
       pkgs.gperftools
+      pkgs.zstd
+      pkgs.zlib
     ];
     #cmakeFlags = [
       #"-DCMAKE_BUILD_TYPE=Debug"
@@ -0,0 +1,196 @@
+#include "batch.hpp"
+#include "request.hpp"
+#include "utils.hpp"
+
+namespace NAC {
+    TServiceBatcher::TArgs TServiceBatcher::TArgs::FromConfig(const nlohmann::json& config) {
+        TArgs out;
+
+        if (config.count("max_size") > 0) {
+            out.MaxSize = config["max_size"].get<size_t>();
+        }
+
+        if (config.count("max_wait") > 0) {
+            out.MaxWait = config["max_wait"].get<size_t>();
+        }
+
+        return out;
+    }
+
+    TServiceBatcher::TServiceBatcher(const TArgs& args)
+        : Args(args)
+        , Thread([this]() { Run(); })
+    {
+    }
+
+    TServiceBatcher::~TServiceBatcher() {
+        {
+            std::unique_lock<std::mutex> lock(Lock);
+            Stopped = true;
+        }
+
+        Wakeup.notify_one();
+        Thread.join();
+    }
+
+    TServiceBatcher::TBatch TServiceBatcher::Add(
+        std::shared_ptr<TRouterDRequest> request,
+        const std::string& path,
+        const std::vector<std::string>& args,
+        TCallback&& cb,
+        TSender&& sender
+    ) {
+        TItem item;
+        item.FirstLine = request->OutgoingFirstLine(path, args);
+        item.Headers = request->GetOutGoingRequest().Headers();
+        item.Parts = request->OutgoingParts();
+        item.Holders = request->PartHolders();
+        item.Request = std::move(request);
+        item.Callback = std::move(cb);
+
+        TBatch out;
+        bool first(false);
+
+        {
+            std::unique_lock<std::mutex> lock(Lock);
+            auto it = Pending.find(item.FirstLine);
+
+            if (it == Pending.end()) {
+                it = Pending.emplace(item.FirstLine, TPending()).first;
+                it->second.Deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(Args.MaxWait);
+                it->second.Sender = std::move(sender);
+                first = true;
+            }
+
+            it->second.Items.push_back(std::move(item));
+
+            if (it->second.Items.size() >= Args.MaxSize) {
+                out.swap(it->second.Items);
+                Pending.erase(it);
+            }
+        }
+
+        if (first) {
+            Wakeup.notify_one();
+        }
+
+        return out;
+    }
+
+    void TServiceBatcher::Run() {
+        std::unique_lock<std::mutex> lock(Lock);
+
+        while (!Stopped) {
+            if (Pending.empty()) {
+                Wakeup.wait(lock);
+                continue;
+            }
+
+            auto next = Pending.begin();
+
+            for (auto it = Pending.begin(); it != Pending.end(); ++it) {
+                if (it->second.Deadline < next->second.Deadline) {
+                    next = it;
+                }
+            }
+
+            if (std::chrono::steady_clock::now() < next->second.Deadline) {
+                Wakeup.wait_until(lock, next->second.Deadline);
+                continue;
+            }
+
+            TBatch batch;
+            batch.swap(next->second.Items);
+            auto sender = std::move(next->second.Sender);
+            Pending.erase(next);
+
+            lock.unlock();
+            sender(std::move(batch));
+            lock.lock();
+        }
+    }
+
+    TBlobSequence TServiceBatcher::Request(const TBatch& batch) {
+        NHTTP::TResponse out;
+        out.FirstLine(batch.front().FirstLine); // it's the same for every item
+        out.Header("Content-Type", "multipart/form-data");
+        out.Header("X-AC-RouterD-Batch", std::to_string(batch.size()));
+
+        for (size_t i = 0; i < batch.size(); ++i) {
+            const auto& item = batch.at(i);
+            const std::string prefix(std::to_string(i));
+
+            {
+                auto part = item.Request->PreparePart(prefix);
+
+                for (const auto& header : item.Headers) {
+                    if (
+                        (header.first == std::string("content-type"))
+                        || (header.first == std::string("content-length"))
+                    ) {
+                        continue;
+                    }
+
+                    AddHeader(header, part);
+                }
+
+                out.AddPart(std::move(part));
+            }
+
+            for (const auto& in : item.Parts) {
+                auto part = item.Request->PreparePart(prefix + "." + in.Name);
+
+                for (const auto& header : in.Headers) {
+                    if (
+                        (header.first == std::string("content-type"))
+                        || (header.first == std::string("content-disposition"))
+                    ) {
+                        continue;
+                    }
+
+                    AddHeader(header, part);
+                }
+
+                if (in.ContentLength > 0) {
+                    part.Wrap(in.ContentLength, in.Content);
+                }
+
+                out.AddPart(std::move(part));
+            }
+        }
+
+        auto msg = (TBlobSequence)out;
+
+        for (const auto& item : batch) {
+            msg.Memorize(item.Request);
+            msg.Memorize(item.Holders);
+        }
+
+        return msg;
+    }
+
+    std::shared_ptr<const TServiceReply> TServiceBatcher::Reply(const std::shared_ptr<const TServiceReply>& reply, size_t index) {
+        if (!reply || !reply->Multipart) {
+            // not a batch reply, e.g. an error: it's the same for everyone
+            return reply;
+        }
+
+        const std::string prefix(std::to_string(index) + ".");
+        auto out = std::make_shared<TServiceReply>();
+        out->Holder = reply->Holder;
+        out->Payloads = reply->Payloads;
+        out->Compressed = reply->Compressed;
+        out->FirstLine = reply->FirstLine;
+        out->StatusCode = reply->StatusCode;
+        out->Multipart = true;
+        out->Size = sizeof(TServiceReply) + out->FirstLine.size();
+
+        for (const auto& part : reply->Parts) {
+            if (part.Name.compare(0, prefix.size(), prefix) == 0) {
+                out->AddPart(part.Name.substr(prefix.size()), part.Part);
+            }
+        }
+
+        return out;
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "reply.hpp"
+#include "frames.hpp"
+#include <ac-common/string_sequence.hpp>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <json.hh>
+
+namespace NAC {
+    class TRouterDRequest;
+
+    // Collects concurrent calls of a service into a single multipart request.
+    // Only calls with the same first line (method, path and query) are batched
+    // together, so that it could be the first line of the batch.
+    // Parts of i-th request are named "i.<name>", and its envelope headers are
+    // passed in part "i". Parts of multipart/x-ac-routerd reply are routed back
+    // to requests by the same prefix.
+    class TServiceBatcher {
+    public:
+        // Receives empty reply if the batch could not be sent
+        using TCallback = std::function<void(std::shared_ptr<const TServiceReply>)>;
+
+        struct TArgs {
+            size_t MaxSize = 16;
+            size_t MaxWait = 1000; // us
+
+            static TArgs FromConfig(const nlohmann::json&);
+        };
+
+        struct TItem {
+            std::shared_ptr<TRouterDRequest> Request;
+            std::string FirstLine;
+            NHTTPLikeParser::THeaders Headers;
+            std::vector<TFramesPart> Parts; // snapshot, since request's envelope keeps changing
+            std::shared_ptr<void> Holders; // of Parts
+            TCallback Callback;
+        };
+
+        using TBatch = std::vector<TItem>;
+        using TSender = std::function<void(TBatch&&)>;
+
+    public:
+        TServiceBatcher(const TArgs& args);
+        ~TServiceBatcher();
+
+        // Returns full batch, which should be sent by the caller right away.
+        // Otherwise the batch is passed to sender once MaxWait has passed,
+        // on the batcher's thread.
+        TBatch Add(
+            std::shared_ptr<TRouterDRequest> request,
+            const std::string& path,
+            const std::vector<std::string>& args,
+            TCallback&& cb,
+            TSender&& sender
+        );
+
+        static TBlobSequence Request(const TBatch& batch);
+        static std::shared_ptr<const TServiceReply> Reply(const std::shared_ptr<const TServiceReply>& reply, size_t index);
+
+    private:
+        struct TPending {
+            TBatch Items;
+            TSender Sender;
+            std::chrono::steady_clock::time_point Deadline;
+        };
+
+        void Run();
+
+    private:
+        TArgs Args;
+        std::mutex Lock;
+        std::condition_variable Wakeup;
+        std::unordered_map<std::string, TPending> Pending; // by first line
+        bool Stopped = false;
+        std::thread Thread;
+    };
+}
@@ -0,0 +1,69 @@
+#include "cache.hpp"
+
+namespace {
+    static const uint64_t Seeds[] = {
+        0xc3a5c85c97cb3127ULL,
+        0xb492b66fbe98f273ULL,
+        0x9ae16a3b2f90404fULL,
+        0xcbf29ce484222325ULL
+    };
+}
+
+namespace NAC {
+    TFrequencySketch::TFrequencySketch(size_t width)
+        : Width(1)
+    {
+        while (Width < width) {
+            Width <<= 1;
+        }
+
+        Counters.resize(Width * Depth, 0);
+        SampleSize = Width * 10;
+    }
+
+    size_t TFrequencySketch::Index(uint64_t hash, size_t row) const {
+        uint64_t h((hash + Seeds[row]) * Seeds[row]);
+        h ^= (h >> 32);
+
+        return (row * Width) + (h & (Width - 1));
+    }
+
+    void TFrequencySketch::Increment(uint64_t hash) {
+        bool incremented(false);
+
+        for (size_t row = 0; row < Depth; ++row) {
+            auto&& counter = Counters[Index(hash, row)];
+
+            if (counter < 15) {
+                ++counter;
+                incremented = true;
+            }
+        }
+
+        if (incremented && (++Additions >= SampleSize)) {
+            Reset();
+        }
+    }
+
+    uint8_t TFrequencySketch::Estimate(uint64_t hash) const {
+        uint8_t out(15);
+
+        for (size_t row = 0; row < Depth; ++row) {
+            const uint8_t counter(Counters[Index(hash, row)]);
+
+            if (counter < out) {
+                out = counter;
+            }
+        }
+
+        return out;
+    }
+
+    void TFrequencySketch::Reset() {
+        for (auto&& counter : Counters) {
+            counter >>= 1;
+        }
+
+        Additions /= 2;
+    }
+}
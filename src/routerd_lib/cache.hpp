@@ -0,0 +1,240 @@
+#pragma once
+
+#include <ac-common/spin_lock.hpp>
+#include <string>
+#include <vector>
+#include <list>
+#include <iterator>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <stdint.h>
+
+namespace NAC {
+    // Count-Min sketch with 4-bit saturating counters, which are halved
+    // periodically, so that the estimation reflects recent popularity.
+    class TFrequencySketch {
+    public:
+        TFrequencySketch(size_t width);
+
+        void Increment(uint64_t hash);
+        uint8_t Estimate(uint64_t hash) const;
+
+    private:
+        size_t Index(uint64_t hash, size_t row) const;
+        void Reset();
+
+    private:
+        static const size_t Depth = 4;
+
+        size_t Width;
+        std::vector<uint8_t> Counters;
+        size_t Additions = 0;
+        size_t SampleSize;
+    };
+
+    // Sharded in-memory cache with W-TinyLFU admission: new entries go to
+    // a small LRU window, and are admitted into the main segmented LRU
+    // only if they are estimated to be more popular than the main's victim.
+    template<typename TValue>
+    class TCache {
+    public:
+        using TValuePtr = std::shared_ptr<const TValue>;
+        using TClock = std::chrono::steady_clock;
+
+        struct TArgs {
+            size_t MaxMemory = 64 * 1024 * 1024;
+            size_t ShardCount = 16;
+        };
+
+    public:
+        TCache(const TArgs& args) {
+            const size_t shardCount(args.ShardCount > 0 ? args.ShardCount : 1);
+            const size_t shardMemory(args.MaxMemory / shardCount);
+            size_t sketchWidth(256);
+
+            // roughly one counter per kilobyte
+            while ((sketchWidth < (shardMemory / 1024)) && (sketchWidth < 65536)) {
+                sketchWidth <<= 1;
+            }
+
+            Shards.reserve(shardCount);
+
+            for (size_t i = 0; i < shardCount; ++i) {
+                Shards.emplace_back(new TShard(shardMemory, sketchWidth));
+            }
+        }
+
+        TValuePtr Get(const std::string& key) {
+            const uint64_t hash(std::hash<std::string>()(key));
+            auto&& shard = ShardFor(hash);
+
+            NUtils::TSpinLockGuard guard(shard.Lock);
+
+            shard.Sketch.Increment(hash);
+
+            const auto& it = shard.Index.find(key);
+
+            if (it == shard.Index.end()) {
+                return TValuePtr();
+            }
+
+            auto entry = it->second;
+
+            if (entry->Expires <= TClock::now()) {
+                shard.Remove(entry);
+                return TValuePtr();
+            }
+
+            shard.Touch(entry);
+
+            return entry->Value;
+        }
+
+        void Put(const std::string& key, TValuePtr value, size_t size, TClock::duration ttl) {
+            const uint64_t hash(std::hash<std::string>()(key));
+            auto&& shard = ShardFor(hash);
+
+            if (size > shard.MaxMemory) {
+                return;
+            }
+
+            NUtils::TSpinLockGuard guard(shard.Lock);
+
+            const auto& it = shard.Index.find(key);
+
+            if (it != shard.Index.end()) {
+                shard.Remove(it->second);
+            }
+
+            auto&& window = shard.Lists[WINDOW];
+            window.emplace_front(TEntry {
+                .Key = key,
+                .Hash = hash,
+                .Value = std::move(value),
+                .Size = size,
+                .Expires = TClock::now() + ttl,
+                .Segment = WINDOW
+            });
+
+            shard.Sizes[WINDOW] += size;
+            shard.Index[key] = window.begin();
+
+            shard.Evict();
+        }
+
+    private:
+        enum ESegment {
+            WINDOW = 0,
+            PROBATION = 1,
+            PROTECTED = 2
+        };
+
+        struct TEntry {
+            std::string Key;
+            uint64_t Hash;
+            TValuePtr Value;
+            size_t Size;
+            TClock::time_point Expires;
+            ESegment Segment;
+        };
+
+        using TList = std::list<TEntry>;
+
+        struct TShard {
+            NUtils::TSpinLock Lock;
+            TFrequencySketch Sketch;
+            TList Lists[3];
+            size_t Sizes[3] = {0, 0, 0};
+            std::unordered_map<std::string, typename TList::iterator> Index;
+            size_t MaxMemory;
+            size_t MaxWindow;
+            size_t MaxProtected;
+
+            TShard(size_t maxMemory, size_t sketchWidth)
+                : Sketch(sketchWidth)
+                , MaxMemory(maxMemory)
+                , MaxWindow(maxMemory / 100)
+                , MaxProtected((maxMemory - MaxWindow) * 4 / 5)
+            {
+            }
+
+            size_t MainSize() const {
+                return Sizes[PROBATION] + Sizes[PROTECTED];
+            }
+
+            void Move(typename TList::iterator entry, ESegment to) {
+                Sizes[entry->Segment] -= entry->Size;
+                Sizes[to] += entry->Size;
+                Lists[to].splice(Lists[to].begin(), Lists[entry->Segment], entry);
+                entry->Segment = to;
+            }
+
+            void Remove(typename TList::iterator entry) {
+                Sizes[entry->Segment] -= entry->Size;
+                Index.erase(entry->Key);
+                Lists[entry->Segment].erase(entry);
+            }
+
+            void Touch(typename TList::iterator entry) {
+                if (entry->Segment == PROBATION) {
+                    Move(entry, PROTECTED);
+
+                    while ((Sizes[PROTECTED] > MaxProtected) && (Lists[PROTECTED].size() > 1)) {
+                        Move(std::prev(Lists[PROTECTED].end()), PROBATION);
+                    }
+
+                } else {
+                    Move(entry, entry->Segment);
+                }
+            }
+
+            typename TList::iterator Victim() {
+                if (!Lists[PROBATION].empty()) {
+                    return std::prev(Lists[PROBATION].end());
+                }
+
+                return std::prev(Lists[PROTECTED].end());
+            }
+
+            void Evict() {
+                while (Sizes[WINDOW] > MaxWindow) {
+                    auto candidate = std::prev(Lists[WINDOW].end());
+                    bool admit(true);
+
+                    while ((MainSize() + candidate->Size) > (MaxMemory - MaxWindow)) {
+                        if (MainSize() == 0) {
+                            admit = false;
+                            break;
+                        }
+
+                        auto victim = Victim();
+
+                        if (Sketch.Estimate(candidate->Hash) <= Sketch.Estimate(victim->Hash)) {
+                            admit = false;
+                            break;
+                        }
+
+                        Remove(victim);
+                    }
+
+                    if (admit) {
+                        Move(candidate, PROBATION);
+
+                    } else {
+                        Remove(candidate);
+                    }
+                }
+            }
+        };
+
+    private:
+        TShard& ShardFor(uint64_t hash) {
+            return *Shards[hash % Shards.size()];
+        }
+
+    private:
+        std::vector<std::unique_ptr<TShard>> Shards;
+    };
+}
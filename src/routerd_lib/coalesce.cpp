@@ -0,0 +1,84 @@
+#include "coalesce.hpp"
+
+namespace NAC {
+    TServiceCoalescer::TArgs TServiceCoalescer::TArgs::FromConfig(const nlohmann::json& config) {
+        TArgs out;
+
+        // the same call for sure, unless told otherwise
+        out.Key.AllParts = true;
+
+        if (config.count("key") > 0) {
+            out.Key = TRequestKeySpec::FromConfig(config["key"]);
+        }
+
+        if (config.count("timeout") > 0) {
+            out.Timeout = config["timeout"].get<size_t>();
+        }
+
+        return out;
+    }
+
+    bool TServiceCoalescer::Join(const std::string& key, const void* leader, TCallback&& cb) {
+        const auto& now = std::chrono::steady_clock::now();
+        NUtils::TSpinLockGuard guard(Lock);
+        auto it = Calls.find(key);
+
+        if (it == Calls.end()) {
+            auto&& call = Calls[key];
+            call.Started = now;
+            call.Leader = leader;
+            return false;
+        }
+
+        if ((now - it->second.Started) > std::chrono::milliseconds(Args.Timeout)) {
+            // leader is probably lost, take over its waiters
+            it->second.Started = now;
+            it->second.Leader = leader;
+            return false;
+        }
+
+        it->second.Waiters.push_back(std::move(cb));
+
+        return true;
+    }
+
+    void TServiceCoalescer::Complete(const std::string& key, std::shared_ptr<const TServiceReply> reply) {
+        std::vector<TCallback> waiters;
+
+        {
+            NUtils::TSpinLockGuard guard(Lock);
+            auto it = Calls.find(key);
+
+            if (it == Calls.end()) {
+                return;
+            }
+
+            waiters.swap(it->second.Waiters);
+            Calls.erase(it);
+        }
+
+        for (const auto& cb : waiters) {
+            cb(reply);
+        }
+    }
+
+    void TServiceCoalescer::Abandon(const std::string& key, const void* leader) {
+        std::vector<TCallback> waiters;
+
+        {
+            NUtils::TSpinLockGuard guard(Lock);
+            auto it = Calls.find(key);
+
+            if ((it == Calls.end()) || (it->second.Leader != leader)) {
+                return;
+            }
+
+            waiters.swap(it->second.Waiters);
+            Calls.erase(it);
+        }
+
+        for (const auto& cb : waiters) {
+            cb(std::shared_ptr<const TServiceReply>());
+        }
+    }
+}
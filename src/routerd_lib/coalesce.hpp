@@ -0,0 +1,64 @@
+#pragma once
+
+#include "key.hpp"
+#include "reply.hpp"
+#include <ac-common/spin_lock.hpp>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <json.hh>
+
+namespace NAC {
+    class TRouterDRequest;
+
+    // Lets concurrent requests share a single in-flight call of a service
+    // with the same key (singleflight). Waiters are called back on the thread
+    // which completes the call, see TRouterDRequest::LockGraph().
+    class TServiceCoalescer {
+    public:
+        // Receives empty reply if the call has failed
+        using TCallback = std::function<void(std::shared_ptr<const TServiceReply>)>;
+
+        struct TArgs {
+            TRequestKeySpec Key;
+            size_t Timeout = 10000; // ms, calls which are in flight for longer are not joined
+
+            static TArgs FromConfig(const nlohmann::json&);
+        };
+
+    public:
+        TServiceCoalescer(const TArgs& args)
+            : Args(args)
+        {
+        }
+
+        std::string Key(TRouterDRequest& request) const {
+            return Args.Key.Build(request);
+        }
+
+        // Returns true if the call is already in flight, cb is called with its reply then.
+        // Otherwise the caller leads the call and must Complete() or Abandon() it.
+        bool Join(const std::string& key, const void* leader, TCallback&& cb);
+
+        // Calls waiters back, so it should not be called under any request's lock
+        void Complete(const std::string& key, std::shared_ptr<const TServiceReply> reply);
+
+        // Fails the call, unless someone else leads it by now, e.g. after the timeout
+        void Abandon(const std::string& key, const void* leader);
+
+    private:
+        struct TCall {
+            std::chrono::steady_clock::time_point Started;
+            const void* Leader = nullptr;
+            std::vector<TCallback> Waiters;
+        };
+
+    private:
+        TArgs Args;
+        NUtils::TSpinLock Lock;
+        std::unordered_map<std::string, TCall> Calls;
+    };
+}
@@ -0,0 +1,116 @@
+#include "compress.hpp"
+#include <zstd.h>
+#include <zlib.h>
+#include <iostream>
+#include <string.h>
+
+namespace NAC {
+    bool CompressZstd(const char* data, size_t size, int level, std::string& out) {
+        out.resize(ZSTD_compressBound(size));
+
+        const size_t rv(ZSTD_compress(&out[0], out.size(), data, size, level));
+
+        if (ZSTD_isError(rv)) {
+            std::cerr << "ZSTD_compress() failed: " << ZSTD_getErrorName(rv) << std::endl;
+            return false;
+        }
+
+        out.resize(rv);
+
+        return true;
+    }
+
+    bool DecompressZstd(const char* data, size_t size, size_t maxSize, std::string& out) {
+        const auto contentSize(ZSTD_getFrameContentSize(data, size));
+
+        if (contentSize == ZSTD_CONTENTSIZE_ERROR) {
+            std::cerr << "not a zstd frame" << std::endl;
+            return false;
+        }
+
+        if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN) {
+            // declared size is not trusted beyond the limit
+            if (contentSize > maxSize) {
+                std::cerr << "zstd frame is too large: " << contentSize << " bytes" << std::endl;
+                return false;
+            }
+
+            out.resize(contentSize);
+
+            const size_t rv(ZSTD_decompress(&out[0], out.size(), data, size));
+
+            if (ZSTD_isError(rv)) {
+                std::cerr << "ZSTD_decompress() failed: " << ZSTD_getErrorName(rv) << std::endl;
+                return false;
+            }
+
+            out.resize(rv);
+
+            return true;
+        }
+
+        // streaming compressors do not store the size in the frame header
+        ZSTD_DStream* stream = ZSTD_createDStream();
+        ZSTD_initDStream(stream);
+
+        ZSTD_inBuffer in {data, size, 0};
+        std::string chunk(ZSTD_DStreamOutSize(), '\0');
+        ZSTD_outBuffer buf {&chunk[0], chunk.size(), 0};
+        size_t rv(0);
+
+        out.clear();
+
+        do {
+            buf.pos = 0;
+            rv = ZSTD_decompressStream(stream, &buf, &in);
+
+            if (ZSTD_isError(rv)) {
+                std::cerr << "ZSTD_decompressStream() failed: " << ZSTD_getErrorName(rv) << std::endl;
+                break;
+            }
+
+            if ((out.size() + buf.pos) > maxSize) {
+                std::cerr << "zstd stream is too large" << std::endl;
+                ZSTD_freeDStream(stream);
+                return false;
+            }
+
+            out.append(chunk.data(), buf.pos);
+
+        } while ((in.pos < in.size) || (buf.pos == buf.size));
+
+        ZSTD_freeDStream(stream);
+
+        return (!ZSTD_isError(rv) && (rv == 0));
+    }
+
+    bool CompressGzip(const char* data, size_t size, int level, std::string& out) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+
+        // 16 for gzip header and trailer instead of zlib ones
+        if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            std::cerr << "deflateInit2() failed" << std::endl;
+            return false;
+        }
+
+        out.resize(deflateBound(&stream, size));
+
+        stream.next_in = (Bytef*)data;
+        stream.avail_in = size;
+        stream.next_out = (Bytef*)&out[0];
+        stream.avail_out = out.size();
+
+        const int rv(deflate(&stream, Z_FINISH));
+
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+
+        if (rv != Z_STREAM_END) {
+            std::cerr << "deflate() failed: " << rv << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+}
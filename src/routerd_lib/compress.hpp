@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+#include <stddef.h>
+
+namespace NAC {
+    // Whole-buffer codecs, out is replaced with the result
+    bool CompressZstd(const char* data, size_t size, int level, std::string& out);
+    bool DecompressZstd(const char* data, size_t size, size_t maxSize, std::string& out); // fails if result exceeds maxSize
+    bool CompressGzip(const char* data, size_t size, int level, std::string& out);
+}
@@ -0,0 +1,182 @@
+#include "compressor.hpp"
+#include "compress.hpp"
+#include <ac-common/str.hpp>
+#include <string_view>
+#include <unordered_map>
+#include <iostream>
+#include <ctype.h>
+#include <stdlib.h>
+
+namespace {
+    template<typename T>
+    typename NAC::TCache<T>::TArgs VariantsArgs(const NAC::TResponseCompressor::TArgs& args) {
+        typename NAC::TCache<T>::TArgs out;
+        out.MaxMemory = args.MaxMemory;
+
+        return out;
+    }
+
+    std::string Normalize(const std::string& in) {
+        std::string out;
+
+        for (char c : in) {
+            if (!isspace(c)) {
+                out += (char)tolower(c);
+            }
+        }
+
+        return out;
+    }
+}
+
+namespace NAC {
+    TResponseCompressor::TArgs TResponseCompressor::TArgs::FromConfig(const nlohmann::json& config) {
+        TArgs out;
+
+        if (config.count("encodings") > 0) {
+            out.Encodings.clear();
+
+            for (const auto& encoding : config["encodings"].get<std::vector<std::string>>()) {
+                if (IsSupported(encoding)) { // unsupported ones are reported by the caller
+                    out.Encodings.push_back(encoding);
+                }
+            }
+        }
+
+        if (config.count("gzip_level") > 0) {
+            out.GzipLevel = config["gzip_level"].get<int>();
+        }
+
+        if (config.count("zstd_level") > 0) {
+            out.ZstdLevel = config["zstd_level"].get<int>();
+        }
+
+        if (config.count("min_size") > 0) {
+            out.MinSize = config["min_size"].get<size_t>();
+        }
+
+        if (config.count("max_memory") > 0) {
+            out.MaxMemory = config["max_memory"].get<size_t>();
+        }
+
+        return out;
+    }
+
+    bool TResponseCompressor::IsSupported(const std::string& encoding) {
+        return ((encoding == std::string("zstd")) || (encoding == std::string("gzip")));
+    }
+
+    TResponseCompressor::TResponseCompressor(const TArgs& args)
+        : Args(args)
+        , Variants(VariantsArgs<TVariant>(args))
+    {
+    }
+
+    bool TResponseCompressor::Applies(const TServiceReplyPart& message) const {
+        if (Args.Encodings.empty() || (message.ContentLength < Args.MinSize)) {
+            return false;
+        }
+
+        if (!message.HeaderValue("content-encoding").empty()) {
+            return false; // compressed by the service itself
+        }
+
+        if (!message.HeaderValue("content-range").empty()) {
+            return false;
+        }
+
+        return (Normalize(message.HeaderValue("cache-control")).find("no-transform") == std::string::npos);
+    }
+
+    std::string TResponseCompressor::Negotiate(const NHTTPLikeParser::THeaders& requestHeaders) const {
+        const auto& it = requestHeaders.find("accept-encoding");
+
+        if (it == requestHeaders.end()) {
+            return std::string();
+        }
+
+        std::unordered_map<std::string, double> listed;
+        double wildcardQ(0);
+
+        for (const auto& value : it->second) {
+            for (const auto& item : NStringUtils::Split(value, ',')) {
+                const auto& params = NStringUtils::Split(item, ';');
+
+                if (params.empty()) {
+                    continue;
+                }
+
+                const std::string coding(Normalize(std::string(params.front())));
+                double q(1);
+
+                for (size_t i = 1; i < params.size(); ++i) {
+                    const std::string param(Normalize(std::string(params.at(i))));
+
+                    if (param.compare(0, 2, "q=") == 0) {
+                        q = atof(param.c_str() + 2);
+                    }
+                }
+
+                if (coding == std::string("*")) {
+                    wildcardQ = q;
+
+                } else {
+                    listed[coding] = q;
+                }
+            }
+        }
+
+        std::string out;
+        double bestQ(0);
+
+        for (const auto& encoding : Args.Encodings) {
+            // '*' stands only for codings which are not listed, e.g. not for gzip in "gzip;q=0, *"
+            const auto& listedIt = listed.find(encoding);
+            const double q((listedIt == listed.end()) ? wildcardQ : listedIt->second);
+
+            if (q > bestQ) { // the first one of equally acceptable is preferred
+                out = encoding;
+                bestQ = q;
+            }
+        }
+
+        return out;
+    }
+
+    std::shared_ptr<const std::string> TResponseCompressor::Compress(
+        const std::string& encoding,
+        const TServiceReplyPart& message
+    ) {
+        const std::string key(
+            encoding + ":" + std::to_string(message.ContentLength) + ":"
+            + std::to_string(std::hash<std::string_view>()(std::string_view(message.Content, message.ContentLength)))
+        );
+
+        const std::string_view original(message.Content, message.ContentLength);
+
+        if (auto variant = Variants.Get(key)) {
+            if (std::string_view(variant->Original) == original) {
+                return std::shared_ptr<const std::string>(variant, &variant->Compressed);
+            }
+        }
+
+        auto variant = std::make_shared<TVariant>();
+        bool compressed(false);
+
+        if (encoding == std::string("zstd")) {
+            compressed = CompressZstd(message.Content, message.ContentLength, Args.ZstdLevel, variant->Compressed);
+
+        } else if (encoding == std::string("gzip")) {
+            compressed = CompressGzip(message.Content, message.ContentLength, Args.GzipLevel, variant->Compressed);
+        }
+
+        if (!compressed || (variant->Compressed.size() >= message.ContentLength)) {
+            return std::shared_ptr<const std::string>();
+        }
+
+        variant->Original.assign(original.data(), original.size());
+        Variants.Put(key, variant, sizeof(TVariant) + key.size() + variant->Original.size() + variant->Compressed.size(), std::chrono::hours(24));
+
+        return std::shared_ptr<const std::string>(variant, &variant->Compressed);
+    }
+}
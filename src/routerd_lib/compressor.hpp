@@ -0,0 +1,51 @@
+#pragma once
+
+#include "cache.hpp"
+#include "reply.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <json.hh>
+
+namespace NAC {
+    // Compresses responses sent to clients according to their Accept-Encoding.
+    // Compressed variants are cached by hash of the body, so that identical
+    // responses are not compressed again. Variants keep the original body,
+    // which is compared on hit, since hashes could collide.
+    class TResponseCompressor {
+    public:
+        struct TArgs {
+            std::vector<std::string> Encodings = {"zstd", "gzip"}; // in order of preference
+            int GzipLevel = 6;
+            int ZstdLevel = 3;
+            size_t MinSize = 1024; // smaller responses are sent as is
+            size_t MaxMemory = 16 * 1024 * 1024; // of cached variants
+
+            static TArgs FromConfig(const nlohmann::json&);
+        };
+
+        static bool IsSupported(const std::string& encoding);
+
+    public:
+        TResponseCompressor(const TArgs& args);
+
+        // Whether the response could be compressed at all, so that it varies by Accept-Encoding
+        bool Applies(const TServiceReplyPart& message) const;
+
+        // Best of supported encodings acceptable by the client, empty if there is none
+        std::string Negotiate(const NHTTPLikeParser::THeaders& requestHeaders) const;
+
+        // Null if compression has failed or does not pay off
+        std::shared_ptr<const std::string> Compress(const std::string& encoding, const TServiceReplyPart& message);
+
+    private:
+        struct TVariant {
+            std::string Original;
+            std::string Compressed;
+        };
+
+    private:
+        TArgs Args;
+        TCache<TVariant> Variants;
+    };
+}
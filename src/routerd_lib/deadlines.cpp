@@ -0,0 +1,57 @@
+#include "deadlines.hpp"
+
+namespace NAC {
+    TDeadlines::TDeadlines()
+        : Thread([this]() { Run(); })
+    {
+    }
+
+    TDeadlines::~TDeadlines() {
+        {
+            std::unique_lock<std::mutex> lock(Lock);
+            Stopped = true;
+        }
+
+        Wakeup.notify_one();
+        Thread.join();
+    }
+
+    void TDeadlines::Add(TClock::time_point deadline, TCallback&& cb) {
+        bool first(false);
+
+        {
+            std::unique_lock<std::mutex> lock(Lock);
+            auto it = Callbacks.emplace(deadline, std::move(cb));
+            first = (it == Callbacks.begin());
+        }
+
+        if (first) {
+            Wakeup.notify_one();
+        }
+    }
+
+    void TDeadlines::Run() {
+        std::unique_lock<std::mutex> lock(Lock);
+
+        while (!Stopped) {
+            if (Callbacks.empty()) {
+                Wakeup.wait(lock);
+                continue;
+            }
+
+            auto it = Callbacks.begin();
+
+            if (TClock::now() < it->first) {
+                Wakeup.wait_until(lock, it->first);
+                continue;
+            }
+
+            auto cb = std::move(it->second);
+            Callbacks.erase(it);
+
+            lock.unlock();
+            cb();
+            lock.lock();
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+
+namespace NAC {
+    // Calls callbacks once their deadlines have passed, from a thread of its own,
+    // so callbacks should be short and take locks of whatever they touch
+    class TDeadlines {
+    public:
+        using TClock = std::chrono::steady_clock;
+        using TCallback = std::function<void()>;
+
+    public:
+        TDeadlines();
+        ~TDeadlines();
+
+        void Add(TClock::time_point deadline, TCallback&& cb);
+
+    private:
+        void Run();
+
+    private:
+        std::mutex Lock;
+        std::condition_variable Wakeup;
+        std::multimap<TClock::time_point, TCallback> Callbacks;
+        bool Stopped = false;
+        std::thread Thread;
+    };
+}
@@ -0,0 +1,270 @@
+#include "frames.hpp"
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+namespace {
+    void PutU32(std::string& out, uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out += (char)((value >> shift) & 0xff);
+        }
+    }
+
+    void PutU64(std::string& out, uint64_t value) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            out += (char)((value >> shift) & 0xff);
+        }
+    }
+
+    class TReader {
+    public:
+        TReader(const char* data, size_t size)
+            : Data(data)
+            , Size(size)
+        {
+        }
+
+        bool U32(uint32_t& out) {
+            uint64_t value(0);
+
+            if (!Int(4, value)) {
+                return false;
+            }
+
+            out = value;
+
+            return true;
+        }
+
+        bool U64(uint64_t& out) {
+            return Int(8, out);
+        }
+
+        bool Bytes(uint64_t size, const char*& out) {
+            if (size > (Size - Pos)) {
+                return false;
+            }
+
+            out = Data + Pos;
+            Pos += size;
+
+            return true;
+        }
+
+        bool AtEnd() const {
+            return (Pos == Size);
+        }
+
+        size_t Left() const {
+            return (Size - Pos);
+        }
+
+    private:
+        bool Int(size_t size, uint64_t& out) {
+            if (size > (Size - Pos)) {
+                return false;
+            }
+
+            out = 0;
+
+            for (size_t i = 0; i < size; ++i) {
+                out = (out << 8) | (unsigned char)Data[Pos + i];
+            }
+
+            Pos += size;
+
+            return true;
+        }
+
+    private:
+        const char* Data;
+        size_t Size;
+        size_t Pos = 0;
+    };
+
+    bool ParseHeaders(const char* data, size_t size, NAC::NHTTPLikeParser::THeaders& out) {
+        const char* end = data + size;
+
+        while (data < end) {
+            const char* eol = (const char*)memmem(data, end - data, "\r\n", 2);
+
+            if (!eol) {
+                return false;
+            }
+
+            const char* colon = (const char*)memchr(data, ':', eol - data);
+
+            if (!colon) {
+                return false;
+            }
+
+            std::string name(data, colon - data);
+
+            for (auto& c : name) {
+                c = tolower(c);
+            }
+
+            ++colon;
+
+            while ((colon < eol) && isspace(*colon)) {
+                ++colon;
+            }
+
+            out[name].emplace_back(colon, eol - colon);
+            data = eol + 2;
+        }
+
+        return true;
+    }
+}
+
+namespace NAC {
+    void TFramesWriter::AddPart(
+        const std::string& name,
+        const NHTTPLikeParser::THeaders& headers,
+        const char* content,
+        size_t contentLength
+    ) {
+        TPart part;
+        const auto& it = NameIds.find(name);
+
+        if (it == NameIds.end()) {
+            part.NameId = Names.size();
+            NameIds.emplace(name, part.NameId);
+            Names.push_back(name);
+
+        } else {
+            part.NameId = it->second;
+        }
+
+        for (const auto& header : headers) {
+            if ((header.first == "content-length") || (header.first == "content-disposition")) {
+                continue;
+            }
+
+            for (const auto& value : header.second) {
+                part.Headers += header.first + ": " + value + "\r\n";
+            }
+        }
+
+        part.Content = content;
+        part.ContentLength = contentLength;
+
+        Parts.push_back(std::move(part));
+    }
+
+    TFramesWriter::TFrames TFramesWriter::Finish() const {
+        size_t metaSize(12);
+
+        for (const auto& name : Names) {
+            metaSize += 4 + name.size();
+        }
+
+        for (const auto& part : Parts) {
+            metaSize += 16 + part.Headers.size();
+        }
+
+        TFrames out;
+        out.Meta = std::make_shared<std::string>();
+
+        auto&& meta = *out.Meta;
+        meta.reserve(metaSize); // segments point into it, so it must not reallocate
+        meta += "ACRF";
+        PutU32(meta, Names.size());
+
+        for (const auto& name : Names) {
+            PutU32(meta, name.size());
+            meta += name;
+        }
+
+        PutU32(meta, Parts.size());
+
+        size_t metaOffset(0);
+
+        for (const auto& part : Parts) {
+            PutU32(meta, part.NameId);
+            PutU32(meta, part.Headers.size());
+            meta += part.Headers;
+            PutU64(meta, part.ContentLength);
+
+            if (part.ContentLength > 0) {
+                out.Segments.push_back(TSegment{meta.data() + metaOffset, meta.size() - metaOffset});
+                out.Segments.push_back(TSegment{part.Content, part.ContentLength});
+                metaOffset = meta.size();
+            }
+        }
+
+        if (metaOffset < meta.size()) {
+            out.Segments.push_back(TSegment{meta.data() + metaOffset, meta.size() - metaOffset});
+        }
+
+        for (const auto& segment : out.Segments) {
+            out.Size += segment.Size;
+        }
+
+        return out;
+    }
+
+    bool ParseFrames(const char* data, size_t size, std::vector<TFramesPart>& out) {
+        if ((size < 4) || (memcmp(data, "ACRF", 4) != 0)) {
+            return false;
+        }
+
+        TReader reader(data + 4, size - 4);
+        uint32_t nameCount;
+
+        if (!reader.U32(nameCount)) {
+            return false;
+        }
+
+        std::vector<std::string> names;
+
+        for (uint32_t i = 0; i < nameCount; ++i) {
+            uint32_t nameSize;
+            const char* name;
+
+            if (!reader.U32(nameSize) || !reader.Bytes(nameSize, name)) {
+                return false;
+            }
+
+            names.emplace_back(name, nameSize);
+        }
+
+        uint32_t partCount;
+
+        if (!reader.U32(partCount)) {
+            return false;
+        }
+
+        // part count comes from the service, so it's only trusted as far as the reply could hold that many parts:
+        // each takes at least a name id, a header block size and a body size
+        out.reserve(out.size() + std::min<size_t>(partCount, reader.Left() / (4 + 4 + 8)));
+
+        for (uint32_t i = 0; i < partCount; ++i) {
+            uint32_t nameId;
+            uint32_t headersSize;
+            uint64_t contentLength;
+            const char* headers;
+            TFramesPart part;
+
+            if (
+                !reader.U32(nameId)
+                || (nameId >= names.size())
+                || !reader.U32(headersSize)
+                || !reader.Bytes(headersSize, headers)
+                || !ParseHeaders(headers, headersSize, part.Headers)
+                || !reader.U64(contentLength)
+                || !reader.Bytes(contentLength, part.Content)
+            ) {
+                return false;
+            }
+
+            part.Name = names.at(nameId);
+            part.ContentLength = contentLength;
+
+            out.push_back(std::move(part));
+        }
+
+        return reader.AtEnd();
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <ac-library/http/abstract_message.hpp>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <stdint.h>
+
+namespace NAC {
+    // Length-prefixed alternative to multipart envelopes.
+    // All integers are big-endian:
+    //
+    //   "ACRF"
+    //   u32 name count
+    //     u32 name size, name
+    //   u32 part count
+    //     u32 name id, u32 header block size, header block, u64 body size, body
+    //
+    // Header block is a sequence of "Name: value\r\n" lines.
+    static const std::string FramesContentType("application/x-ac-routerd-frames");
+
+    struct TFramesPart {
+        std::string Name;
+        NHTTPLikeParser::THeaders Headers;
+        const char* Content = nullptr;
+        size_t ContentLength = 0;
+    };
+
+    class TFramesWriter {
+    public:
+        // Body of the envelope as a sequence of segments: names, length prefixes
+        // and header blocks are stored in Meta, bodies are not copied.
+        struct TSegment {
+            const char* Data = nullptr;
+            size_t Size = 0;
+        };
+
+        struct TFrames {
+            std::shared_ptr<std::string> Meta;
+            std::vector<TSegment> Segments;
+            size_t Size = 0;
+        };
+
+    public:
+        void AddPart(
+            const std::string& name,
+            const NHTTPLikeParser::THeaders& headers,
+            const char* content,
+            size_t contentLength
+        );
+
+        TFrames Finish() const;
+
+    private:
+        struct TPart {
+            uint32_t NameId = 0;
+            std::string Headers;
+            const char* Content = nullptr;
+            size_t ContentLength = 0;
+        };
+
+    private:
+        std::vector<std::string> Names;
+        std::unordered_map<std::string, uint32_t> NameIds;
+        std::vector<TPart> Parts;
+    };
+
+    // Parsed parts point into the data, which must outlive them.
+    bool ParseFrames(const char* data, size_t size, std::vector<TFramesPart>& out);
+}
@@ -0,0 +1,24 @@
+#include "memory.hpp"
+#include <routerd_lib/memory.hpp>
+#include <json.hh>
+
+namespace NAC {
+    void TRouterDMemoryHandler::Handle(
+        const std::shared_ptr<NHTTP::TRequest> request,
+        const std::vector<std::string>& args
+    ) {
+        auto out = nlohmann::json::object();
+
+        out["held"] = TMemoryUsage::Total();
+        out["max_total_memory"] = MaxTotalMemory;
+        out["requests"] = TInFlightGuard::Count();
+        out["shed"] = TMemoryUsage::ShedOverTotalCount();
+        out["over_budget"] = TMemoryUsage::ShedOverRequestCount();
+
+        auto&& response = request->Respond200();
+        response.Header("Content-Type", "application/json");
+        response.Write(out.dump());
+
+        request->Send(std::move(response));
+    }
+}
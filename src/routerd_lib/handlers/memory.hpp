@@ -0,0 +1,24 @@
+#pragma once
+
+#include <ac-library/http/handler/handler.hpp>
+#include <vector>
+#include <memory>
+
+namespace NAC {
+    class TRouterDMemoryHandler : public NHTTPHandler::THandler {
+    public:
+        TRouterDMemoryHandler(size_t maxTotalMemory)
+            : NHTTPHandler::THandler()
+            , MaxTotalMemory(maxTotalMemory)
+        {
+        }
+
+        void Handle(
+            const std::shared_ptr<NHTTP::TRequest> request,
+            const std::vector<std::string>& args
+        ) override;
+
+    private:
+        size_t MaxTotalMemory;
+    };
+}
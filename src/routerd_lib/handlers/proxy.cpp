@@ -5,7 +5,12 @@
 #include <random>
 #include <routerd_lib/utils.hpp>
 #include <routerd_lib/stat.hpp>
+#include <routerd_lib/service_cache.hpp>
+#include <routerd_lib/route_cache.hpp>
+#include <routerd_lib/compressor.hpp>
+#include <routerd_lib/coalesce.hpp>
 #include <ac-common/utils/string.hpp>
+#include <ac-common/spin_lock.hpp>
 #include <iostream>
 
 namespace NAC {
@@ -23,13 +28,229 @@ namespace NAC {
         }
 #endif
 
+        if (request->IsOverTotalMemoryBudget()) {
+            TMemoryUsage::ShedOverTotal();
+            Reject(request, "503 Service Unavailable");
+            return;
+        }
+
+        if (RouteCache) {
+            auto key = RouteCache->Key(*request);
+
+            if (!key.empty()) {
+                if (auto entry = RouteCache->Get(key)) {
+                    SendOutput(request, entry->Reply, entry->Part, entry->ContentDispositionFormData, entry->Age());
+
+                    if (entry->IsFresh() || !entry->StartRevalidation()) {
+                        return;
+                    }
+
+                    // stale: execute the graph in background to refresh the entry
+                }
+
+                request->SetRouteCacheKey(std::move(key));
+            }
+        }
+
+        if (Graph.Timeout > 0) {
+            std::weak_ptr<TRouterDRequest> request_(request);
+
+            Deadlines->Add(TDeadlines::TClock::now() + std::chrono::milliseconds(Graph.Timeout), [this, request_]() {
+                if (auto request = request_.lock()) {
+                    Expire(request);
+                }
+            });
+        }
+
+        if (Graph.Passthrough) {
+            Passthrough(request, args);
+            return;
+        }
+
         request->SetGraph(Graph);
 
-        Iter(request, args);
+        WithGraphLock(request, [this, &request, &args]() {
+            Iter(request, args);
+        });
+    }
+
+    void TRouterDProxyHandler::Passthrough(std::shared_ptr<TRouterDRequest> request, const std::vector<std::string>& args) const {
+        const auto& service = Graph.Services.at("output");
+        const auto& host = GetHost(service.HostsFrom);
+
+        auto rv = AwaitResponse(*request, host, [this, request](std::shared_ptr<NHTTP::TIncomingResponse> response) {
+            // reply is forwarded as is, even if it's multipart
+            auto reply = std::make_shared<TServiceReply>();
+            reply->Holder = response;
+            reply->FirstLine = response->FirstLine();
+            reply->StatusCode = response->StatusCode();
+            reply->AddPart(std::string(), *response);
+            request->AccountMemory(reply->Size, reply->Holder);
+
+            const auto& part = reply->Parts.front().Part;
+
+            WithGraphLock(request, [this, &request, &reply, &part]() {
+                if (request->IsCancelled()) {
+                    return;
+                }
+
+                if (!request->IsResponseSent()) {
+                    SendOutput(request, reply, part, /* contentDispositionFormData = */true);
+                }
+
+                if (RouteCache && !request->RouteCacheKey().empty()) {
+                    RouteCache->Put(request->RouteCacheKey(), reply, part, /* contentDispositionFormData = */true);
+                }
+            });
+        });
+
+        if (!rv) {
+            request->Send500();
+            return;
+        }
+
+        request->AddUpstream(rv);
+
+        auto msg = request->PassthroughRequest(service.Path, args);
+        msg.Memorize(request);
+
+        rv->PushWriteQueueData(std::move(msg));
+    }
+
+    void TRouterDProxyHandler::Expire(const std::shared_ptr<TRouterDRequest>& request) const {
+        // called from the thread of Deadlines, see TRouterDRequest::LockGraph() on calling from other threads
+        WithGraphLock(request, [this, &request]() {
+            if (request->IsCancelled()) {
+                return;
+            }
+
+            if (!request->IsResponseSent()) {
+                Reject(request, "504 Gateway Timeout");
+            }
+
+            request->Cancel();
+        });
+    }
+
+    void TRouterDProxyHandler::Reject(const std::shared_ptr<TRouterDRequest>& request, const std::string& status) const {
+        static const NHTTPLikeParser::THeaders headers;
+        size_t statusCode(0);
+
+        NStringUtils::FromString(status.substr(0, status.find(' ')), statusCode);
+
+        NHTTP::TResponse out;
+        out.FirstLine(request->Protocol() + " " + status + "\r\n");
+        request->Send(out);
+
+        ReportOutput(request, statusCode, TServiceReplyPart(headers, nullptr, 0));
+    }
+
+    void TRouterDProxyHandler::SendOutput(
+        const std::shared_ptr<TRouterDRequest>& request,
+        const std::shared_ptr<const TServiceReply>& reply,
+        const TServiceReplyPart& message,
+        bool contentDispositionFormData,
+        const std::string& age
+    ) const {
+        {
+            NHTTP::TResponse out;
+            out.FirstLine(reply->FirstLine + "\r\n");
+
+            const bool compressible(Compressor && Compressor->Applies(message));
+            std::string encoding;
+            std::shared_ptr<const std::string> compressed;
+
+            if (compressible) {
+                encoding = Compressor->Negotiate(request->Headers());
+
+                if (!encoding.empty()) {
+                    compressed = Compressor->Compress(encoding, message);
+                }
+            }
+
+            // compressed body is not byte-for-byte the same, so strong validator does not apply to it
+            const std::string etag(message.HeaderValue("etag"));
+            const bool weakenETag(compressed && !etag.empty() && (etag.compare(0, 2, "W/") != 0));
+
+            if ((age.empty() || (message.Headers->count("age") == 0)) && !weakenETag) {
+                CopyHeaders(*message.Headers, out, /* contentType = */true, contentDispositionFormData);
+
+            } else {
+                auto headers = *message.Headers;
+
+                if (!age.empty()) {
+                    headers.erase("age"); // Age of the stored reply is accounted in age
+                }
+
+                if (weakenETag) {
+                    headers["etag"] = {"W/" + etag};
+                }
+
+                CopyHeaders(headers, out, /* contentType = */true, contentDispositionFormData);
+            }
+
+            if (!age.empty()) {
+                out.Header("Age", age);
+            }
+
+            if (compressible) {
+                out.Header("Vary", "Accept-Encoding");
+            }
+
+            if (compressed) {
+                out.Header("Content-Encoding", encoding);
+            }
+
+            if (compressed) {
+                out.Wrap(compressed->size(), compressed->data());
+                out.Memorize(std::const_pointer_cast<std::string>(compressed));
+
+            } else if (message.ContentLength > 0) {
+                out.Wrap(message.ContentLength, message.Content);
+            }
+
+            out.Memorize(reply->Holder);
+
+            request->Send(out);
+        }
+
+        ReportOutput(request, reply->StatusCode, message);
+    }
+
+    void TRouterDProxyHandler::ReportOutput(
+        const std::shared_ptr<TRouterDRequest>& request,
+        size_t statusCode,
+        const TServiceReplyPart& message
+    ) const {
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - request->StartTime()).count();
+        const auto& statusCodeHint = message.HeaderValue("x-ac-routerd-statuscode");
+
+        if (!statusCodeHint.empty()) {
+            NStringUtils::FromString(statusCodeHint, statusCode);
+        }
+
+        TStatReport report;
+        report.OutputStatusCode = statusCode;
+        report.TotalTime = elapsed;
+        StatWriter->Write(report);
+    }
+
+    std::shared_ptr<NHTTPServer::TClientBase> TRouterDProxyHandler::AwaitResponse(
+        TRouterDRequest& request,
+        const TServiceHost& host,
+        std::function<void(std::shared_ptr<NHTTP::TIncomingResponse>)>&& cb
+    ) const {
+        return request.AwaitHTTP(host.Addr.c_str(), host.Port, host.SSL, [cb = std::move(cb)](
+            std::shared_ptr<NHTTP::TIncomingResponse> response,
+            std::shared_ptr<NHTTPServer::TClientBase> client
+        ) {
+            client->Drop(); // TODO
+            cb(response);
+        });
     }
 
     const TServiceHost& TRouterDProxyHandler::GetHost(const std::string& service) const {
-        const auto& hosts = Hosts.at(service);
+        const auto& hosts = Hosts.at(service).Hosts;
 
         if (hosts.size() > 1) {
             thread_local static std::random_device rd;
@@ -103,12 +324,42 @@ namespace NAC {
     }
 #endif
 
+    void TRouterDProxyHandler::WithGraphLock(const std::shared_ptr<TRouterDRequest>& request, const std::function<void()>& cb) const {
+        std::vector<std::function<void()>> deferred;
+
+        {
+            auto lock = request->LockGraph();
+            cb();
+            deferred = request->TakeDeferred();
+        }
+
+        for (const auto& it : deferred) {
+            it();
+        }
+    }
+
     void TRouterDProxyHandler::Iter(std::shared_ptr<TRouterDRequest> request, const std::vector<std::string>& args) const {
+        if (request->IsCancelled()) {
+            return;
+        }
+
+        if (request->IsOverMemoryBudget()) {
+            TMemoryUsage::ShedOverRequest();
+
+            if (!request->IsResponseSent()) {
+                Reject(request, "503 Service Unavailable");
+            }
+
+            request->Cancel();
+            return;
+        }
+
         auto&& graph = request->GetGraph();
 
         while (true) {
             bool somethingHappened(false);
             std::vector<std::string> failedServices;
+            std::vector<std::pair<const TService*, std::shared_ptr<const TServiceReply>>> readyReplies;
 
             // schedule next possible request
             for (auto&& treeIt : graph.Tree) {
@@ -124,49 +375,137 @@ namespace NAC {
 #endif
 
                 const auto& service = graph.Services.at(treeIt.first);
-                const auto& host = GetHost(service.HostsFrom);
 
-                // try to connect (no sending yet), and schedule response behavior in a callback
-                auto rv = request->AwaitHTTP(host.Addr.c_str(), host.Port, host.SSL, [this, request, &service, args](
-                    std::shared_ptr<NHTTP::TIncomingResponse> response,
-                    std::shared_ptr<NHTTPServer::TClientBase> client
+                if (!service.MapOver.empty()) {
+                    auto state = MapState(request, service);
+
+                    if (state->Items.empty()) {
+                        // nothing to map over: reply with no parts
+                        auto reply = std::make_shared<TServiceReply>();
+                        reply->Multipart = true;
+
+                        readyReplies.emplace_back(&service, std::move(reply));
+
+                    } else if (MapNext(request, service, args, state)) {
+                        request->NewRequest(service.Name);
+
+                    } else {
+                        failedServices.push_back(service.Name);
+                    }
+
+                    continue;
+                }
+
+                std::string cacheKey;
+
+                if (service.Cache) {
+                    cacheKey = service.Cache->Key(*request);
+
+                    if (auto reply = service.Cache->Get(cacheKey)) {
+                        readyReplies.emplace_back(&service, std::move(reply));
+                        continue;
+                    }
+                }
+
+                std::string coalesceKey;
+
+                if (service.Coalescer) {
+                    coalesceKey = service.Coalescer->Key(*request);
+
+                    // reply is delivered from the thread of the leading request
+                    const bool joined(service.Coalescer->Join(coalesceKey, request.get(), [this, request, &service, args](
+                        std::shared_ptr<const TServiceReply> reply
+                    ) {
+                        DeliverServiceReply(request, service, args, std::move(reply));
+                    }));
+
+                    if (joined) {
+                        request->NewRequest(service.Name);
+                        continue;
+                    }
+
+                    request->LeadCall(service.Coalescer, coalesceKey);
+                }
+
+                auto onReply = [this, request, &service, args, cacheKey, coalesceKey](
+                    std::shared_ptr<const TServiceReply> reply
                 ) {
-                    client->Drop(); // TODO
-                    request->NewReply(service.Name);
-                    bool serviceReplyProcessed(false);
+                    // replies of coalesced calls and cache hits are charged to the request which made the call;
+                    // reply which is not multipart is the same for the whole batch, so it's charged to the first request
+                    if (reply && (!service.Batcher || reply->Multipart)) {
+                        request->AccountMemory(reply->Size, reply->Holder);
+                    }
+
+                    if (service.Cache && reply) {
+                        service.Cache->Put(cacheKey, reply);
+                    }
 
-                    if (response->ContentType() == std::string("multipart/x-ac-routerd")) {
+                    if (service.Coalescer) {
+                        service.Coalescer->Complete(coalesceKey, reply);
+                    }
 
-                        for (const auto& part : response->Parts()) {
-                            std::string partName;
-                            NStringUtils::Strip(part.ContentDispositionParams().at("filename"), partName, 2, "\"'");
+                    DeliverServiceReply(request, service, args, std::move(reply));
+                };
 
-                            if (partName == service.Name) {
-                                serviceReplyProcessed = true;
-                            }
+                // could not connect
+                auto onFailure = [&request, &service, &coalesceKey, &failedServices]() {
+                    if (service.Coalescer) {
+                        auto coalescer = service.Coalescer;
+
+                        request->Defer([coalescer, coalesceKey]() {
+                            coalescer->Complete(coalesceKey, std::shared_ptr<const TServiceReply>());
+                        });
+                    }
+
+                    failedServices.push_back(service.Name);
+                };
+
+                if (!service.Race.empty()) {
+                    if (Race(request, service, args, std::move(onReply))) {
+                        request->NewRequest(service.Name);
 
-                            ProcessServiceResponse(request, response, partName, &part, /* contentDispositionFormData = */false);
-                        }
                     } else {
-                        if (!service.SaveAs.empty()) {
-                            ProcessServiceResponse(request, response, service.SaveAs, response.get());
-                        } else {
-                            ProcessServiceResponse(request, response, service.Name, response.get());
-                            serviceReplyProcessed = true;
-                        }
+                        onFailure();
                     }
-                    if (!serviceReplyProcessed) {
-                        ServiceReplied(request, service.Name);
+
+                    continue;
+                }
+
+                if (service.Batcher) {
+                    const auto& hostsFrom = service.HostsFrom;
+                    auto batch = service.Batcher->Add(request, service.Path, args, std::move(onReply), [this, hostsFrom](
+                        TServiceBatcher::TBatch&& batch
+                    ) {
+                        SendBatch(hostsFrom, std::move(batch));
+                    });
+
+                    request->NewRequest(service.Name);
+
+                    if (!batch.empty()) {
+                        auto batch_ = std::make_shared<TServiceBatcher::TBatch>(std::move(batch));
+
+                        request->Defer([this, hostsFrom, batch_]() {
+                            SendBatch(hostsFrom, std::move(*batch_));
+                        });
                     }
 
-                    Iter(request, args); // recursion depth is limited by graph size, which is small.
+                    continue;
+                }
+
+                const auto& host = GetHost(service.HostsFrom);
+                const auto& group = Hosts.at(service.HostsFrom);
+
+                // try to connect (no sending yet), and schedule response behavior in a callback
+                auto rv = AwaitResponse(*request, host, [onReply, &group](std::shared_ptr<NHTTP::TIncomingResponse> response) {
+                    onReply(TServiceReply::FromResponse(response, group));
                 });
 
-                if (!rv) { // could not connect
-                    failedServices.push_back(service.Name);
+                if (!rv) {
+                    onFailure();
                     continue;
                 }
 
+                request->AddUpstream(rv);
                 request->NewRequest(service.Name);
 
 #ifdef AC_DEBUG_ROUTERD_PROXY
@@ -182,7 +521,10 @@ namespace NAC {
                         std::cerr << "to service " << service.Name
                                   << " will send_raw_output_of " << service.SendRawOutputOf << std::endl;
 #endif
-                        rv->PushWriteQueueData(matchingPart->GetBody());
+                        auto body = matchingPart->GetBody();
+                        body.Memorize(request->PartHolders()); // keeps shared reply buffer alive until it's written
+
+                        rv->PushWriteQueueData(std::move(body));
 
                     } else { // should not happen: we are demanding proper dependencies
                         request->Send500();
@@ -191,10 +533,7 @@ namespace NAC {
                     }
 
                 } else {
-                    auto msg = request->OutgoingRequest(service.Path, args);
-                    msg.Memorize(request);
-
-                    rv->PushWriteQueueData(msg);
+                    rv->PushWriteQueueData(OutgoingRequest(request, service.HostsFrom, service.Path, args));
                 }
             }
 
@@ -205,6 +544,17 @@ namespace NAC {
 #endif
                 graph.Tree.erase(name);
             }
+
+            // replies which are known without calling services are processed
+            // out of the loop above, since they modify graph.Tree
+            if (!readyReplies.empty()) {
+                for (auto&& [service, reply] : readyReplies) {
+                    ProcessServiceReply(request, *service, std::move(reply));
+                }
+
+                continue;
+            }
+
 #ifdef AC_DEBUG_ROUTERD_PROXY
             std::cerr << "request->InProgressCount() == " << request->InProgressCount() << std::endl;
 #endif
@@ -257,6 +607,352 @@ namespace NAC {
 
             break;
         }
+
+        ReleaseParts(request);
+    }
+
+    void TRouterDProxyHandler::ReleaseParts(const std::shared_ptr<TRouterDRequest>& request) const {
+        const auto& graph = request->GetGraph();
+
+        if (!graph.Dependents) {
+            return;
+        }
+
+        // part is needed until all services which depend on it, or on its producer,
+        // have been called (or are not going to be called at all)
+        auto isWaitedFor = [&graph, &request](const std::string& name) {
+            const auto& it = graph.Dependents->find(name);
+
+            if (it == graph.Dependents->end()) {
+                return false;
+            }
+
+            for (const auto& dependent : it->second) {
+                if ((graph.Tree.count(dependent) > 0) && !request->IsInProgress(dependent)) {
+                    return true;
+                }
+            }
+
+            return false;
+        };
+
+        request->ReleaseParts([&isWaitedFor](const std::string& name, const std::string& producer) {
+            return (!isWaitedFor(name) && !isWaitedFor(producer));
+        });
+    }
+
+    TBlobSequence TRouterDProxyHandler::OutgoingRequest(
+        const std::shared_ptr<TRouterDRequest>& request,
+        const std::string& hostsFrom,
+        const std::string& path,
+        const std::vector<std::string>& args
+    ) const {
+        const auto& group = Hosts.at(hostsFrom);
+        auto msg = (group.Frames
+            ? request->OutgoingFrames(path, args, group)
+            : request->OutgoingRequest(path, args, group));
+        msg.Memorize(request);
+
+        return msg;
+    }
+
+    bool TRouterDProxyHandler::Race(
+        const std::shared_ptr<TRouterDRequest>& request,
+        const TService& service,
+        const std::vector<std::string>& args,
+        TServiceReplyCallback&& onReply
+    ) const {
+        // Callbacks of the losers hold this state only, not the request
+        struct TRaceState {
+            NUtils::TSpinLock Lock;
+            size_t Pending = 1; // until all alternatives are dispatched
+            bool Done = false;
+            TServiceReplyCallback OnReply;
+            std::shared_ptr<const TServiceReply> LastReply;
+
+            // Returns callback to be called with the reply, if the race is over
+            TServiceReplyCallback Finish(std::shared_ptr<const TServiceReply> reply) {
+                NUtils::TSpinLockGuard guard(Lock);
+                --Pending;
+
+                if (Done) {
+                    return TServiceReplyCallback();
+                }
+
+                if (reply) {
+                    LastReply = std::move(reply);
+                }
+
+                const bool success(LastReply && (LastReply->StatusCode >= 200) && (LastReply->StatusCode < 300));
+
+                if (!success && (Pending > 0)) {
+                    return TServiceReplyCallback();
+                }
+
+                Done = true;
+
+                return std::move(OnReply);
+            }
+        };
+
+        auto state = std::make_shared<TRaceState>();
+        state->OnReply = std::move(onReply);
+        size_t dispatched(0);
+
+        for (const auto& alternative : service.Race) {
+            const auto& host = GetHost(alternative.HostsFrom);
+            const auto& group = Hosts.at(alternative.HostsFrom);
+
+            {
+                NUtils::TSpinLockGuard guard(state->Lock);
+                ++state->Pending;
+            }
+
+            auto rv = AwaitResponse(*request, host, [state, &group](std::shared_ptr<NHTTP::TIncomingResponse> response) {
+                auto reply = TServiceReply::FromResponse(response, group);
+
+                if (auto onReply = state->Finish(reply)) {
+                    onReply(state->LastReply);
+                }
+            });
+
+            if (!rv) {
+                NUtils::TSpinLockGuard guard(state->Lock);
+                --state->Pending;
+                continue;
+            }
+
+            ++dispatched;
+            request->AddUpstream(rv);
+            rv->PushWriteQueueData(OutgoingRequest(request, alternative.HostsFrom, alternative.Path, args));
+        }
+
+        if (dispatched == 0) {
+            return false;
+        }
+
+        // all alternatives could have failed already
+        if (auto onReply = state->Finish(std::shared_ptr<const TServiceReply>())) {
+            auto reply = state->LastReply;
+
+            request->Defer([onReply, reply]() {
+                onReply(reply);
+            });
+        }
+
+        return true;
+    }
+
+    std::shared_ptr<TRouterDProxyHandler::TMapState> TRouterDProxyHandler::MapState(
+        const std::shared_ptr<TRouterDRequest>& request,
+        const TService& service
+    ) const {
+        auto state = std::make_shared<TMapState>();
+        state->Holders = request->PartHolders(); // items and parts outlive the envelope, which parts could be released from meanwhile
+        const std::string prefix(service.MapOver + ".");
+        const TFramesPart* whole(nullptr);
+        const auto& parts = request->OutgoingParts();
+
+        for (const auto& part : parts) {
+            if (part.Name.compare(0, prefix.size(), prefix) == 0) {
+                state->Items.push_back(part);
+
+            } else if (part.Name == service.MapOver) {
+                whole = &part;
+
+            } else {
+                state->Parts.push_back(part);
+            }
+        }
+
+        if (!state->Items.empty() || !whole) {
+            return state;
+        }
+
+        const auto& json = nlohmann::json::parse(whole->Content, whole->Content + whole->ContentLength, nullptr, false);
+
+        if (!json.is_array()) {
+            state->Items.push_back(*whole);
+            return state;
+        }
+
+        size_t bodiesSize(0);
+
+        for (const auto& element : json) {
+            auto body = std::make_shared<std::string>(element.dump());
+            TFramesPart item;
+            item.Name = service.MapOver;
+            item.Content = body->data();
+            item.ContentLength = body->size();
+
+            bodiesSize += body->size();
+            state->Items.push_back(std::move(item));
+            state->Bodies.push_back(std::move(body));
+        }
+
+        state->BodiesCharge = request->ChargeMemory(bodiesSize);
+
+        return state;
+    }
+
+    bool TRouterDProxyHandler::MapNext(
+        const std::shared_ptr<TRouterDRequest>& request,
+        const TService& service,
+        const std::vector<std::string>& args,
+        std::shared_ptr<TMapState> state
+    ) const {
+        bool dispatched(false);
+
+        while (
+            !state->Failed
+            && (state->Next < state->Items.size())
+            && ((service.MapConcurrency == 0) || (state->InFlight < service.MapConcurrency))
+        ) {
+            const size_t index(state->Next++);
+            const auto& host = GetHost(service.HostsFrom);
+
+            auto rv = AwaitResponse(*request, host, [this, request, &service, args, state, index](
+                std::shared_ptr<NHTTP::TIncomingResponse> response
+            ) {
+                auto reply = TServiceReply::FromResponse(response, Hosts.at(service.HostsFrom));
+
+                WithGraphLock(request, [this, &request, &service, &args, &state, index, &reply]() {
+                    MapReplied(request, service, args, state, index, std::move(reply));
+                });
+            });
+
+            if (!rv) {
+                state->Failed = true;
+                break;
+            }
+
+            request->AddUpstream(rv);
+
+            auto msg = request->OutgoingItemRequest(service.Path, args, state->Parts, service.MapOver, index, state->Items.at(index));
+            msg.Memorize(request);
+            msg.Memorize(state); // JSON elements and holders of the rest of items
+
+            rv->PushWriteQueueData(std::move(msg));
+
+            ++state->InFlight;
+            dispatched = true;
+        }
+
+        return dispatched;
+    }
+
+    void TRouterDProxyHandler::MapReplied(
+        const std::shared_ptr<TRouterDRequest>& request,
+        const TService& service,
+        const std::vector<std::string>& args,
+        std::shared_ptr<TMapState> state,
+        size_t index,
+        std::shared_ptr<const TServiceReply> reply
+    ) const {
+        --state->InFlight;
+
+        if (request->IsCancelled()) {
+            return;
+        }
+
+        if (!reply) {
+            state->Failed = true;
+
+        } else if (!state->Failed) {
+            request->AccountMemory(reply->Size, reply->Holder); // calls of mapped services are never shared
+
+            // results are indexed parts, in the same form as the ones mapped over
+            const std::string suffix("." + std::to_string(index));
+
+            if (reply->Multipart) {
+                for (const auto& part : reply->Parts) {
+                    ProcessServiceResponse(request, reply, service.Name, part.Name + suffix, part.Part, /* contentDispositionFormData = */false);
+                }
+
+            } else {
+                const auto& name = (service.SaveAs.empty() ? service.Name : service.SaveAs);
+
+                ProcessServiceResponse(request, reply, service.Name, name + suffix, reply->Parts.front().Part);
+            }
+
+            MapNext(request, service, args, state);
+        }
+
+        if (state->InFlight > 0) {
+            return;
+        }
+
+        request->NewReply(service.Name);
+
+        if (state->Failed) {
+            // dependents are not called with partial results, as if the service could not be called
+            request->GetGraph().Tree.erase(service.Name);
+
+        } else {
+            ServiceReplied(request, service.Name);
+        }
+
+        Iter(request, args);
+    }
+
+    void TRouterDProxyHandler::DeliverServiceReply(
+        const std::shared_ptr<TRouterDRequest>& request,
+        const TService& service,
+        const std::vector<std::string>& args,
+        std::shared_ptr<const TServiceReply> reply
+    ) const {
+        WithGraphLock(request, [this, &request, &service, &args, &reply]() {
+            if (request->IsCancelled()) {
+                return;
+            }
+
+            if (reply) {
+                ProcessServiceReply(request, service, std::move(reply));
+
+            } else { // call was shared with some other request, which could not make it
+                request->NewReply(service.Name);
+                request->GetGraph().Tree.erase(service.Name);
+            }
+
+            Iter(request, args); // recursion depth is limited by graph size, which is small.
+        });
+    }
+
+    void TRouterDProxyHandler::SendBatch(const std::string& hostsFrom, TServiceBatcher::TBatch&& batch) const {
+        const auto& host = GetHost(hostsFrom);
+        const auto& group = Hosts.at(hostsFrom);
+        auto batch_ = std::make_shared<TServiceBatcher::TBatch>(std::move(batch));
+        auto&& leader = batch_->front().Request;
+        bool sent(false);
+
+        {
+            // batch could be sent from a thread of another request, or from the batcher's one:
+            // connection is owned by the first request, and callbacks take graph locks of their own
+            // requests (see TRouterDRequest::LockGraph() on calling from other threads)
+            auto lock = leader->LockGraph();
+            auto rv = AwaitResponse(*leader, host, [batch_, &group](std::shared_ptr<NHTTP::TIncomingResponse> response) {
+                auto reply = TServiceReply::FromResponse(response, group);
+
+                if (reply && !reply->Multipart) {
+                    batch_->front().Request->AccountMemory(reply->Size, reply->Holder);
+                }
+
+                for (size_t i = 0; i < batch_->size(); ++i) {
+                    batch_->at(i).Callback(TServiceBatcher::Reply(reply, i));
+                }
+            });
+
+            if (rv) {
+                rv->PushWriteQueueData(TServiceBatcher::Request(*batch_));
+                sent = true;
+            }
+        }
+
+        if (!sent) {
+            for (const auto& item : *batch_) {
+                item.Callback(std::shared_ptr<const TServiceReply>());
+            }
+        }
     }
 
     void TRouterDProxyHandler::ServiceReplied(std::shared_ptr<TRouterDRequest> request, const std::string& serviceName) const {
@@ -269,11 +965,48 @@ namespace NAC {
 
         if (it1 != graph.ReverseTree.end()) {
             for (const auto& it2 : it1->second) {
+                auto it3 = graph.Tree.find(it2);
+
+                if (it3 == graph.Tree.end()) {
+                    // dependent has already been called, since its quorum was met without this service
+                    continue;
+                }
+
 #ifdef AC_DEBUG_ROUTERD_PROXY
                 std::cerr << "graph.Tree.at(" << it2 << ").erase(" << it1->first << ");" << std::endl;
 #endif
 
-                graph.Tree.at(it2).erase(it1->first);
+                auto&& deps = it3->second;
+                deps.erase(it1->first);
+
+                const auto& quorums = graph.Quorums.find(it2);
+
+                if (quorums == graph.Quorums.end()) {
+                    continue;
+                }
+
+                for (const auto& quorum : quorums->second) {
+                    if (quorum.Members.count(serviceName) == 0) {
+                        continue;
+                    }
+
+                    size_t replied(0);
+
+                    for (const auto& member : quorum.Members) {
+                        if (deps.count(member) == 0) {
+                            ++replied;
+                        }
+                    }
+
+                    if (replied < quorum.K) {
+                        continue;
+                    }
+
+                    // replies of the rest of members are not waited for
+                    for (const auto& member : quorum.Members) {
+                        deps.erase(member);
+                    }
+                }
             }
 
 #ifdef AC_DEBUG_ROUTERD_PROXY
@@ -290,56 +1023,140 @@ namespace NAC {
         graph.Tree.erase(serviceName);
     }
 
-    void TRouterDProxyHandler::ProcessServiceResponse(
+    void TRouterDProxyHandler::ProcessServiceReply(
         std::shared_ptr<TRouterDRequest> request,
-        std::shared_ptr<NHTTP::TIncomingResponse> response,
-        const std::string& serviceName,
-        const NHTTP::TAbstractMessage* message,
-        bool contentDispositionFormData
+        const TService& service,
+        std::shared_ptr<const TServiceReply> reply
     ) const {
-        ServiceReplied(request, serviceName);
+        request->NewReply(service.Name);
+        bool serviceReplyProcessed(false);
 
-        if ((serviceName == std::string("output")) && !request->IsResponseSent()) { // TODO
-            {
-                NHTTP::TResponse out;
-                out.FirstLine(response->FirstLine() + "\r\n");
-                CopyHeaders(message->Headers(), out, /* contentType = */true, contentDispositionFormData);
-
-                if (message->ContentLength() > 0) {
-                    out.Wrap(message->ContentLength(), message->Content());
+        if (reply->Multipart) {
+            for (const auto& part : reply->Parts) {
+                if (part.Name == service.Name) {
+                    serviceReplyProcessed = true;
                 }
 
-                out.Memorize(response);
+                ProcessServiceResponse(request, reply, service.Name, part.Name, part.Part, /* contentDispositionFormData = */false);
+            }
 
-                request->Send(out);
+        } else {
+            const auto& part = reply->Parts.front().Part;
+
+            if (!service.SaveAs.empty()) {
+                ProcessServiceResponse(request, reply, service.Name, service.SaveAs, part);
+
+            } else {
+                ProcessServiceResponse(request, reply, service.Name, service.Name, part);
+                serviceReplyProcessed = true;
             }
+        }
 
-            {
-                auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - request->StartTime()).count();
-                size_t statusCode = response->StatusCode();
-                const auto& statusCodeHint = message->HeaderValue("x-ac-routerd-statuscode");
+        if (!serviceReplyProcessed) {
+            ServiceReplied(request, service.Name);
+        }
 
-                if (!statusCodeHint.empty()) {
-                    NStringUtils::FromString(statusCodeHint, statusCode);
-                }
+        // service could tell that some of the rest of the graph is not needed anymore
+        for (const auto& part : reply->Parts) {
+            const auto& skip = part.Part.HeaderValue("x-ac-routerd-skip");
+
+            if (!skip.empty()) {
+                Skip(request, skip);
+            }
+        }
 
-                TStatReport report;
-                report.OutputStatusCode = statusCode;
-                report.TotalTime = elapsed;
-                StatWriter->Write(report);
+        for (const auto& part : reply->Parts) {
+            if (!part.Part.HeaderValue("x-ac-routerd-short-circuit").empty()) {
+                ShortCircuit(request, service, reply, part.Part);
+                break;
+            }
+        }
+    }
+
+    void TRouterDProxyHandler::Skip(std::shared_ptr<TRouterDRequest> request, const std::string& names) const {
+        auto&& graph = request->GetGraph();
+
+        for (const auto& name_ : NStringUtils::Split(names, ',')) {
+            std::string name;
+            NStringUtils::Strip(std::string(name_), name, 2, " \t");
+
+            if ((name == std::string("output")) || (graph.Services.count(name) == 0)) {
+                // not a service, or the one which can't be skipped
+                continue;
+            }
+
+            if ((graph.Tree.count(name) == 0) || request->IsInProgress(name)) {
+                // already called
+                continue;
+            }
+
+#ifdef AC_DEBUG_ROUTERD_PROXY
+            std::cerr << "skipping " << name << std::endl;
+#endif
+
+            // dependents will be called without its reply
+            ServiceReplied(request, name);
+        }
+    }
+
+    void TRouterDProxyHandler::ShortCircuit(
+        std::shared_ptr<TRouterDRequest> request,
+        const TService& service,
+        std::shared_ptr<const TServiceReply> reply,
+        const TServiceReplyPart& part
+    ) const {
+        auto&& graph = request->GetGraph();
+
+#ifdef AC_DEBUG_ROUTERD_PROXY
+        std::cerr << "short circuit, " << graph.Tree.size() << " service(s) left" << std::endl;
+#endif
+
+        if (!request->IsResponseSent()) {
+            ProcessServiceResponse(request, reply, service.Name, "output", part, /* contentDispositionFormData = */!reply->Multipart);
+        }
+
+        // services in flight will still reply, but nothing else is called
+        graph.Tree.clear();
+        graph.ReverseTree.clear();
+    }
+
+    void TRouterDProxyHandler::ProcessServiceResponse(
+        std::shared_ptr<TRouterDRequest> request,
+        std::shared_ptr<const TServiceReply> reply,
+        const std::string& producer,
+        const std::string& serviceName,
+        const TServiceReplyPart& message,
+        bool contentDispositionFormData
+    ) const {
+        ServiceReplied(request, serviceName);
+
+        if (serviceName == std::string("output")) {
+            if (!request->IsResponseSent()) { // TODO
+                SendOutput(request, reply, message, contentDispositionFormData);
+            }
+
+            if (RouteCache && !request->RouteCacheKey().empty()) {
+                RouteCache->Put(request->RouteCacheKey(), reply, message, contentDispositionFormData);
+                request->SetRouteCacheKey(std::string());
             }
         }
 
         {
             auto part = request->PreparePart(serviceName);
-            CopyHeaders(message->Headers(), part, /* contentType = */false, /* contentDispositionFormData = */false);
+            CopyHeaders(*message.Headers, part, /* contentType = */false, /* contentDispositionFormData = */false);
 
-            if (message->ContentLength() > 0) {
-                part.Wrap(message->ContentLength(), message->Content());
+            if (message.ContentLength > 0) {
+                part.Wrap(message.ContentLength, message.Content);
             }
 
-            part.Memorize(response);
-            request->AddPart(std::move(part));
+            request->AddPart(std::move(part), serviceName, producer, reply->Holder);
+            request->AddSharedPayloads(reply->Payloads);
+
+            const auto& compressed = reply->Compressed.find(message.Content);
+
+            if (compressed != reply->Compressed.end()) {
+                request->AddCompressedBody(message.Content, message.ContentLength, compressed->second);
+            }
         }
     }
 }
@@ -3,28 +3,43 @@
 #include <ac-library/http/handler/handler.hpp>
 #include <routerd_lib/structs.hpp>
 #include <routerd_lib/request.hpp>
+#include <routerd_lib/reply.hpp>
+#include <routerd_lib/batch.hpp>
+#include <routerd_lib/deadlines.hpp>
 #include <utility>
 #include <unordered_map>
 #include <ac-library/http/server/await_client.hpp>
 #include <ac-library/http/abstract_message.hpp>
 #include <memory>
+#include <functional>
 
 namespace NAC {
     class TStatWriter;
+    class TRouteCache;
+    class TResponseCompressor;
 
     class TRouterDProxyHandler : public NHTTPHandler::THandler {
     public:
         struct TArgs {
-            const std::unordered_map<std::string, std::vector<TServiceHost>>& Hosts;
+            const TServiceHostsGroups& Hosts;
             TRouterDGraph Graph;
+            std::shared_ptr<TDeadlines> Deadlines; // required if Graph has Timeout
         };
 
     public:
-        TRouterDProxyHandler(const TArgs& args, std::shared_ptr<TStatWriter> statWriter)
+        TRouterDProxyHandler(
+            const TArgs& args,
+            std::shared_ptr<TStatWriter> statWriter,
+            std::shared_ptr<TRouteCache> routeCache = std::shared_ptr<TRouteCache>(),
+            std::shared_ptr<TResponseCompressor> compressor = std::shared_ptr<TResponseCompressor>()
+        )
             : NHTTPHandler::THandler()
             , Hosts(args.Hosts)
             , Graph(args.Graph)
+            , Deadlines(args.Deadlines)
             , StatWriter(statWriter)
+            , RouteCache(routeCache)
+            , Compressor(compressor)
         {
         }
 
@@ -42,13 +57,101 @@ namespace NAC {
 
     private:
         const TServiceHost& GetHost(const std::string& service) const;
+
+        // Connects to the host (nothing is sent yet), cb receives complete response of it.
+        // Every call of a service goes through here.
+        std::shared_ptr<NHTTPServer::TClientBase> AwaitResponse(
+            TRouterDRequest& request,
+            const TServiceHost& host,
+            std::function<void(std::shared_ptr<NHTTP::TIncomingResponse>)>&& cb
+        ) const;
+        void Passthrough(std::shared_ptr<TRouterDRequest> request, const std::vector<std::string>& args) const;
+        void Expire(const std::shared_ptr<TRouterDRequest>& request) const;
+        void Reject(const std::shared_ptr<TRouterDRequest>& request, const std::string& status) const;
+        void SendOutput(
+            const std::shared_ptr<TRouterDRequest>& request,
+            const std::shared_ptr<const TServiceReply>& reply,
+            const TServiceReplyPart& message,
+            bool contentDispositionFormData,
+            const std::string& age = std::string() // set if the response is served from route cache
+        ) const;
+        void ReportOutput(
+            const std::shared_ptr<TRouterDRequest>& request,
+            size_t statusCode,
+            const TServiceReplyPart& message
+        ) const;
+        using TServiceReplyCallback = std::function<void(std::shared_ptr<const TServiceReply>)>;
+
+        // Calls of a service, which is mapped over parts of its dependency.
+        // Accessed under request's graph lock only.
+        struct TMapState {
+            std::vector<TFramesPart> Items;
+            std::vector<std::shared_ptr<std::string>> Bodies; // of items, which are JSON array elements
+            std::shared_ptr<void> BodiesCharge;
+            std::vector<TFramesPart> Parts; // the rest of dependencies, as they were when mapping has started
+            std::shared_ptr<void> Holders;
+            size_t Next = 0;
+            size_t InFlight = 0;
+            bool Failed = false; // some item could not be mapped, so the whole service has failed
+        };
+
+        std::shared_ptr<TMapState> MapState(const std::shared_ptr<TRouterDRequest>& request, const TService& service) const;
+        bool MapNext(
+            const std::shared_ptr<TRouterDRequest>& request,
+            const TService& service,
+            const std::vector<std::string>& args,
+            std::shared_ptr<TMapState> state
+        ) const;
+        void MapReplied(
+            const std::shared_ptr<TRouterDRequest>& request,
+            const TService& service,
+            const std::vector<std::string>& args,
+            std::shared_ptr<TMapState> state,
+            size_t index,
+            std::shared_ptr<const TServiceReply> reply
+        ) const;
+
+        TBlobSequence OutgoingRequest(
+            const std::shared_ptr<TRouterDRequest>& request,
+            const std::string& hostsFrom,
+            const std::string& path,
+            const std::vector<std::string>& args
+        ) const;
+        bool Race(
+            const std::shared_ptr<TRouterDRequest>& request,
+            const TService& service,
+            const std::vector<std::string>& args,
+            TServiceReplyCallback&& onReply
+        ) const;
+        void WithGraphLock(const std::shared_ptr<TRouterDRequest>& request, const std::function<void()>& cb) const;
         void Iter(std::shared_ptr<TRouterDRequest> request, const std::vector<std::string>& args) const;
+        void ReleaseParts(const std::shared_ptr<TRouterDRequest>& request) const;
+        void DeliverServiceReply(
+            const std::shared_ptr<TRouterDRequest>& request,
+            const TService& service,
+            const std::vector<std::string>& args,
+            std::shared_ptr<const TServiceReply> reply
+        ) const;
+        void SendBatch(const std::string& hostsFrom, TServiceBatcher::TBatch&& batch) const;
         void ServiceReplied(std::shared_ptr<TRouterDRequest> request, const std::string& serviceName) const;
+        void ProcessServiceReply(
+            std::shared_ptr<TRouterDRequest> request,
+            const TService& service,
+            std::shared_ptr<const TServiceReply> reply
+        ) const;
+        void Skip(std::shared_ptr<TRouterDRequest> request, const std::string& names) const;
+        void ShortCircuit(
+            std::shared_ptr<TRouterDRequest> request,
+            const TService& service,
+            std::shared_ptr<const TServiceReply> reply,
+            const TServiceReplyPart& part
+        ) const;
         void ProcessServiceResponse(
             std::shared_ptr<TRouterDRequest> request,
-            std::shared_ptr<NHTTP::TIncomingResponse> response,
+            std::shared_ptr<const TServiceReply> reply,
+            const std::string& producer,
             const std::string& serviceName,
-            const NHTTP::TAbstractMessage* part,
+            const TServiceReplyPart& part,
             bool contentDispositionFormData = true
         ) const;
 #ifdef AC_DEBUG_ROUTERD_PROXY
@@ -56,8 +159,11 @@ namespace NAC {
 #endif
 
     private:
-        const std::unordered_map<std::string, std::vector<TServiceHost>>& Hosts;
+        const TServiceHostsGroups& Hosts;
         TRouterDGraph Graph;
+        std::shared_ptr<TDeadlines> Deadlines;
         std::shared_ptr<TStatWriter> StatWriter;
+        std::shared_ptr<TRouteCache> RouteCache;
+        std::shared_ptr<TResponseCompressor> Compressor;
     };
 }
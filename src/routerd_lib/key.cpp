@@ -0,0 +1,227 @@
+#include "key.hpp"
+#include "request.hpp"
+#include <string_view>
+#include <algorithm>
+#include <ctype.h>
+#include <openssl/sha.h>
+
+namespace {
+    void Append(std::string& out, const std::string_view& value) {
+        out += std::to_string(value.size());
+        out += ':';
+        out.append(value.data(), value.size());
+    }
+
+    // Bodies are identified by SHA-256, so that different bodies do not share a key
+    // (and a reply) in practice, unlike with std::hash
+    void AppendDigest(std::string& out, const char* data, size_t size) {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+
+        SHA256((const unsigned char*)data, size, digest);
+        out.append((const char*)digest, sizeof(digest));
+    }
+
+    std::string NormalizePath(const std::string_view& in) {
+        std::string out;
+        out.reserve(in.size());
+
+        for (size_t i = 0; i < in.size(); ++i) {
+            if ((in[i] == '/') && !out.empty() && (out.back() == '/')) {
+                continue;
+            }
+
+            out += in[i];
+        }
+
+        return out;
+    }
+
+    std::string NormalizeQuery(const std::string_view& in) {
+        std::vector<std::string_view> pairs;
+        size_t pos(0);
+
+        while (pos < in.size()) {
+            size_t end(in.find('&', pos));
+
+            if (end == std::string_view::npos) {
+                end = in.size();
+            }
+
+            if (end > pos) {
+                pairs.push_back(in.substr(pos, end - pos));
+            }
+
+            pos = end + 1;
+        }
+
+        std::sort(pairs.begin(), pairs.end());
+
+        std::string out;
+
+        for (const auto& pair : pairs) {
+            if (!out.empty()) {
+                out += '&';
+            }
+
+            out.append(pair.data(), pair.size());
+        }
+
+        return out;
+    }
+
+    void AppendHeaders(std::string& out, const NAC::NHTTPLikeParser::THeaders& in) {
+        std::vector<std::string> headers;
+
+        for (const auto& header : in) {
+            for (const auto& value : header.second) {
+                headers.push_back(header.first + ": " + value);
+            }
+        }
+
+        std::sort(headers.begin(), headers.end());
+
+        for (const auto& header : headers) {
+            Append(out, header);
+        }
+    }
+
+    std::string Lower(const std::string& in) {
+        std::string out(in);
+
+        for (auto&& c : out) {
+            c = tolower(c);
+        }
+
+        return out;
+    }
+}
+
+namespace NAC {
+    TRequestKeySpec TRequestKeySpec::FromConfig(const nlohmann::json& config) {
+        TRequestKeySpec out;
+
+        if (config.count("method") > 0) {
+            out.Method = config["method"].get<bool>();
+        }
+
+        if (config.count("path") > 0) {
+            out.Path = config["path"].get<bool>();
+        }
+
+        if (config.count("query") > 0) {
+            out.Query = config["query"].get<bool>();
+        }
+
+        if (config.count("normalize") > 0) {
+            out.Normalize = config["normalize"].get<bool>();
+        }
+
+        if (config.count("args") > 0) {
+            out.Args = config["args"].get<std::vector<std::string>>();
+        }
+
+        if (config.count("headers") > 0) {
+            for (const auto& header : config["headers"].get<std::vector<std::string>>()) {
+                out.Headers.push_back(Lower(header));
+            }
+        }
+
+        if (config.count("parts") > 0) {
+            if (config["parts"].is_boolean()) {
+                out.AllParts = config["parts"].get<bool>();
+
+            } else {
+                out.Parts = config["parts"].get<std::vector<std::string>>();
+            }
+        }
+
+        return out;
+    }
+
+    std::string TRequestKeySpec::Build(TRouterDRequest& request) const {
+        std::string out;
+        const std::string firstLine(request.FirstLine());
+        const size_t pathStart(request.Method().size() + 1);
+        std::string_view uri;
+
+        if (firstLine.size() > (pathStart + request.Protocol().size() + 1)) {
+            uri = std::string_view(firstLine.data() + pathStart, firstLine.size() - pathStart - (request.Protocol().size() + 1));
+        }
+
+        const size_t queryStart(uri.find('?'));
+        const auto& path = uri.substr(0, queryStart);
+        const auto& query = ((queryStart == std::string_view::npos) ? std::string_view() : uri.substr(queryStart + 1));
+
+        if (Method) {
+            Append(out, request.Method());
+        }
+
+        if (Path) {
+            Append(out, (Normalize ? NormalizePath(path) : std::string(path)));
+        }
+
+        if (Query) {
+            if (Args.empty()) {
+                Append(out, (Normalize ? NormalizeQuery(query) : std::string(query)));
+
+            } else {
+                for (const auto& arg : Args) {
+                    size_t pos(0);
+
+                    out += '&';
+
+                    while (pos <= query.size()) {
+                        size_t end(query.find('&', pos));
+
+                        if (end == std::string_view::npos) {
+                            end = query.size();
+                        }
+
+                        const auto& pair = query.substr(pos, end - pos);
+                        const size_t eq(pair.find('='));
+
+                        if (pair.substr(0, eq) == arg) {
+                            Append(out, ((eq == std::string_view::npos) ? std::string_view() : pair.substr(eq + 1)));
+                        }
+
+                        pos = end + 1;
+                    }
+                }
+            }
+        }
+
+        for (const auto& header : Headers) {
+            out += '|';
+            Append(out, request.HeaderValue(header));
+        }
+
+        if (AllParts) {
+            const auto& outgoingRequest = request.GetOutGoingRequest();
+
+            // forwarded headers of the request, e.g. Authorization and Cookie, are a part of the call too
+            out += '^';
+            AppendHeaders(out, outgoingRequest.Headers());
+
+            for (const auto& part : outgoingRequest.Parts()) {
+                out += '#';
+                AppendHeaders(out, part.Headers());
+                AppendDigest(out, part.Content(), part.ContentLength());
+            }
+
+        } else if (!Parts.empty()) {
+            const auto& outgoingRequest = request.GetOutGoingRequest();
+
+            for (const auto& name : Parts) {
+                auto part = outgoingRequest.PartByName(name);
+
+                out += '#';
+
+                if (part) {
+                    AppendDigest(out, part->Content(), part->ContentLength());
+                }
+            }
+        }
+
+        return out;
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <json.hh>
+
+namespace NAC {
+    class TRouterDRequest;
+
+    // Describes which request attributes identify the request
+    // for caching and coalescing purposes.
+    struct TRequestKeySpec {
+        bool Method = true;
+        bool Path = true;
+        bool Query = true; // whole query string, unless Args are specified
+        bool Normalize = false; // collapse repeated slashes in path, sort query arguments
+        std::vector<std::string> Args;
+        std::vector<std::string> Headers;
+        std::vector<std::string> Parts; // bodies of these parts are hashed
+        bool AllParts = false; // hash whole outgoing request, including its headers, instead of Parts
+
+        static TRequestKeySpec FromConfig(const nlohmann::json&);
+
+        std::string Build(TRouterDRequest& request) const;
+    };
+}
@@ -1,7 +1,15 @@
 #include "main.hpp"
 #include "stat.hpp"
+#include "service_cache.hpp"
+#include "route_cache.hpp"
+#include "persistent_cache.hpp"
+#include "coalesce.hpp"
+#include "batch.hpp"
+#include "deadlines.hpp"
+#include "compressor.hpp"
 #include <routerd_lib/handlers/proxy.hpp>
 #include <routerd_lib/handlers/stat.hpp>
+#include <routerd_lib/handlers/memory.hpp>
 #include <ac-library/http/server/server.hpp>
 #include <ac-library/http/router/router.hpp>
 #include <stdlib.h>
@@ -23,6 +31,99 @@ namespace {
 
         return nlohmann::json::parse(configFile.Data(), configFile.Data() + configFile.Size());
     }
+
+    bool ParseHosts(const std::string& name, const std::vector<nlohmann::json>& spec, std::vector<NAC::TServiceHost>& hosts) {
+        if (spec.empty()) {
+            std::cerr << name << " has no hosts" << std::endl;
+            return false;
+        }
+
+        hosts.reserve(spec.size());
+
+        for (const auto& host_ : spec) {
+            if (host_.is_string()) {
+                const auto& host = host_.get<std::string>();
+                const ssize_t colon(host.rfind(':'));
+
+                if (colon < 0) {
+                    std::cerr << name << ": " << host << " has no port specified" << std::endl;
+                    return false;
+                }
+
+                std::stringstream ss;
+                unsigned short port;
+                ss << host.data() + colon + 1;
+                ss >> port;
+
+                hosts.emplace_back(NAC::TServiceHost {
+                    .Addr = std::string(host.data(), colon),
+                    .Port = port,
+                    .SSL = false
+                });
+
+            } else {
+                hosts.emplace_back(NAC::TServiceHost {
+                    .Addr = host_["addr"].get<std::string>(),
+                    .Port = host_["port"].get<unsigned short>(),
+                    .SSL = host_["ssl"].get<bool>()
+                });
+            }
+        }
+
+        return true;
+    }
+
+    bool ParseHostsGroup(const std::string& name, const nlohmann::json& spec, NAC::TServiceHostsGroup& group) {
+        if (spec.is_array()) {
+            return ParseHosts(name, spec.get<std::vector<nlohmann::json>>(), group.Hosts);
+        }
+
+        if (spec.count("framing") > 0) {
+            const auto& framing = spec["framing"].get<std::string>();
+
+            if (framing == std::string("frames")) {
+                group.Frames = true;
+
+            } else if (framing != std::string("multipart")) {
+                std::cerr << name << ": unknown framing: " << framing << std::endl;
+                return false;
+            }
+        }
+
+        if (spec.count("shm_threshold") > 0) {
+            group.ShmThreshold = spec["shm_threshold"].get<size_t>();
+        }
+
+        if (spec.count("spill_threshold") > 0) {
+            group.SpillThreshold = spec["spill_threshold"].get<size_t>();
+        }
+
+        if (spec.count("compression") > 0) {
+            const auto& compression = spec["compression"].get<std::string>();
+
+            if (compression == std::string("zstd")) {
+                group.Zstd = true;
+
+            } else if (compression != std::string("none")) {
+                std::cerr << name << ": unsupported compression: " << compression << std::endl;
+                return false;
+            }
+        }
+
+        if (spec.count("compression_level") > 0) {
+            group.CompressionLevel = spec["compression_level"].get<int>();
+        }
+
+        if (spec.count("compression_min_size") > 0) {
+            group.CompressionMinSize = spec["compression_min_size"].get<size_t>();
+        }
+
+        if (spec.count("max_decompressed_size") > 0) {
+            group.MaxDecompressedSize = spec["max_decompressed_size"].get<size_t>();
+        }
+
+        return ParseHosts(name, spec["hosts"].get<std::vector<nlohmann::json>>(), group.Hosts);
+    }
 }
 
 namespace NAC {
@@ -50,48 +151,21 @@ namespace NAC {
         const std::string bind6((config.count("bind6") > 0) ? config["bind6"].get<std::string>() : "");
         const std::string statBind4((config.count("stat_bind4") > 0) ? config["stat_bind4"].get<std::string>() : "");
         const std::string statBind6((config.count("stat_bind6") > 0) ? config["stat_bind6"].get<std::string>() : "");
-        std::unordered_map<std::string, std::vector<TServiceHost>> hosts;
+        TServiceHostsGroups hosts;
 
-        for (const auto& spec : config["hosts"].get<std::unordered_map<std::string, std::vector<nlohmann::json>>>()) {
-            if (spec.second.empty()) {
-                std::cerr << spec.first << " has no hosts" << std::endl;
+        for (const auto& spec : config["hosts"].get<std::unordered_map<std::string, nlohmann::json>>()) {
+            if (!ParseHostsGroup(spec.first, spec.second, hosts[spec.first])) {
                 return 1;
             }
+        }
 
-            auto&& hosts_ = hosts[spec.first];
-            hosts_.reserve(spec.second.size());
-
-            for (const auto& host_ : spec.second) {
-                if (host_.is_string()) {
-                    const auto& host = host_.get<std::string>();
-                    const ssize_t colon(host.rfind(':'));
-
-                    if (colon < 0) {
-                        std::cerr << spec.first << ": " << host << " has no port specified" << std::endl;
-                        return 1;
-                    }
-
-                    std::stringstream ss;
-                    unsigned short port;
-                    ss << host.data() + colon + 1;
-                    ss >> port;
-
-                    hosts_.emplace_back(TServiceHost {
-                        .Addr = std::string(host.data(), colon),
-                        .Port = port,
-                        .SSL = false
-                    });
+        std::shared_ptr<TPersistentCache> persistentCache;
 
-                } else {
-                    hosts_.emplace_back(TServiceHost {
-                        .Addr = host_["addr"].get<std::string>(),
-                        .Port = host_["port"].get<unsigned short>(),
-                        .SSL = host_["ssl"].get<bool>()
-                    });
-                }
-            }
+        if (config.count("persistent_cache") > 0) {
+            persistentCache = std::make_shared<TPersistentCache>(TPersistentCache::TArgs::FromConfig(config["persistent_cache"]));
         }
 
+        auto deadlines = std::make_shared<TDeadlines>();
         std::unordered_map<std::string, TRouterDProxyHandler::TArgs> graphs;
 
         for (const auto& graph : config["graphs"].get<std::unordered_map<std::string, nlohmann::json>>()) {
@@ -140,6 +214,89 @@ namespace NAC {
                         service.SaveAs = service_["save_as"].get<std::string>();
                     }
 
+                    if (service_.count("cache") > 0) {
+                        const auto& cacheArgs = TServiceCache::TArgs::FromConfig(service_["cache"]);
+                        service.Cache = std::make_shared<TServiceCache>(cacheArgs);
+
+                        if (cacheArgs.Persistent) {
+                            if (!persistentCache) {
+                                std::cerr << graph.first << ": service " << name << " has persistent cache, "
+                                          << "but 'persistent_cache' is not configured" << std::endl;
+                                return 1;
+                            }
+
+                            service.Cache->SetPersistent(persistentCache, "s:" + graph.first + ":" + name + ":");
+                        }
+                    }
+
+                    if (service_.count("coalesce") > 0) {
+                        service.Coalescer = std::make_shared<TServiceCoalescer>(TServiceCoalescer::TArgs::FromConfig(service_["coalesce"]));
+                    }
+
+                    if (service_.count("race") > 0) {
+                        if (service_.count("send_raw_output_of") > 0) {
+                            std::cerr << graph.first << ": cannot have both 'race' and 'send_raw_output_of' specified "
+                                      << "for service " << service.Name << std::endl;
+                            return 1;
+                        }
+
+                        for (const auto& alternative_ : service_["race"].get<std::vector<nlohmann::json>>()) {
+                            TRaceAlternative alternative;
+                            alternative.Path = service.Path;
+
+                            if (alternative_.is_string()) {
+                                alternative.HostsFrom = alternative_.get<std::string>();
+
+                            } else {
+                                alternative.HostsFrom = alternative_["hosts_from"].get<std::string>();
+
+                                if (alternative_.count("path") > 0) {
+                                    alternative.Path = alternative_["path"].get<std::string>();
+                                }
+                            }
+
+                            if (hosts.count(alternative.HostsFrom) == 0) {
+                                std::cerr << graph.first << ": unknown hosts group: " << alternative.HostsFrom << std::endl;
+                                return 1;
+                            }
+
+                            service.Race.push_back(std::move(alternative));
+                        }
+                    }
+
+                    if (service_.count("map") > 0) {
+                        for (const auto& option : {"send_raw_output_of", "batch", "race", "cache", "coalesce"}) {
+                            if (service_.count(option) > 0) {
+                                std::cerr << graph.first << ": cannot have both 'map' and '" << option << "' specified "
+                                          << "for service " << service.Name << std::endl;
+                                return 1;
+                            }
+                        }
+
+                        const auto& map = service_["map"];
+                        service.MapOver = map["over"].get<std::string>();
+
+                        if (map.count("concurrency") > 0) {
+                            service.MapConcurrency = map["concurrency"].get<size_t>();
+                        }
+                    }
+
+                    if (service_.count("batch") > 0) {
+                        if (service_.count("send_raw_output_of") > 0) {
+                            std::cerr << graph.first << ": cannot have both 'batch' and 'send_raw_output_of' specified "
+                                      << "for service " << service.Name << std::endl;
+                            return 1;
+                        }
+
+                        if (service_.count("race") > 0) {
+                            std::cerr << graph.first << ": cannot have both 'batch' and 'race' specified "
+                                      << "for service " << service.Name << std::endl;
+                            return 1;
+                        }
+
+                        service.Batcher = std::make_shared<TServiceBatcher>(TServiceBatcher::TArgs::FromConfig(service_["batch"]));
+                    }
+
                     if (service_.count("path") > 0 && service_.count("send_raw_output_of") > 0) {
                         std::cerr << graph.first << ": cannot have both 'path' and 'send_raw_output_of' specified "
                                   << "for service " << service.Name << std::endl;
@@ -147,7 +304,7 @@ namespace NAC {
                     }
                 }
 
-                if (hosts.count(service.HostsFrom) == 0) {
+                if (service.Race.empty() && (hosts.count(service.HostsFrom) == 0)) {
                     std::cerr << graph.first << ": unknown hosts group: " << service.HostsFrom << std::endl;
                     return 1;
                 }
@@ -164,12 +321,38 @@ namespace NAC {
             if (data.count("deps") > 0) {
                 TRouterDGraph::TTree reverseTree;
 
+                TRouterDGraph::TTree plainTree;
+
                 for (const auto& dep : data["deps"].get<std::vector<nlohmann::json>>()) {
                     const auto& a = dep["a"].get<std::string>();
-                    const auto& b = dep["b"].get<std::string>();
+                    TQuorum quorum;
+
+                    if (dep.count("any") > 0) {
+                        for (const auto& b : dep["any"].get<std::vector<std::string>>()) {
+                            quorum.Members.insert(b);
+                        }
+
+                    } else if (dep.count("k_of_n") > 0) {
+                        const auto& kOfN = dep["k_of_n"];
+                        quorum.K = kOfN["k"].get<size_t>();
+
+                        for (const auto& b : kOfN["of"].get<std::vector<std::string>>()) {
+                            quorum.Members.insert(b);
+                        }
 
-                    if (a == b) {
-                        std::cerr << graph.first << ": " << a << " depends on itself, which is wrong" << std::endl;
+                    } else {
+                        quorum.Members.insert(dep["b"].get<std::string>());
+                        quorum.K = 0;
+                    }
+
+                    // K of 0 means "all members" only for plain dependencies
+                    if (
+                        quorum.Members.empty()
+                        || (quorum.K > quorum.Members.size())
+                        || ((dep.count("k_of_n") > 0) && (quorum.K < 1))
+                    ) {
+                        std::cerr << graph.first << ": " << a << " has a dependency group, "
+                                  << "which could not be satisfied" << std::endl;
                         return 1;
                     }
 
@@ -178,13 +361,46 @@ namespace NAC {
                         return 1;
                     }
 
-                    if ((compiledGraph.Services.count(b) == 0) && (dummyServices.count(b) == 0)) {
-                        std::cerr << graph.first << ": unknown service in dependency: " << b << std::endl;
-                        return 1;
+                    for (const auto& b : quorum.Members) {
+                        if (a == b) {
+                            std::cerr << graph.first << ": " << a << " depends on itself, which is wrong" << std::endl;
+                            return 1;
+                        }
+
+                        if ((compiledGraph.Services.count(b) == 0) && (dummyServices.count(b) == 0)) {
+                            std::cerr << graph.first << ": unknown service in dependency: " << b << std::endl;
+                            return 1;
+                        }
+
+                        tree[a].insert(b);
+                        reverseTree[b].insert(a);
+                    }
+
+                    if (quorum.K == 0) {
+                        plainTree[a].insert(quorum.Members.begin(), quorum.Members.end());
+
+                    } else {
+                        compiledGraph.Quorums[a].push_back(std::move(quorum));
                     }
+                }
 
-                    tree[a].insert(b);
-                    reverseTree[b].insert(a);
+                for (const auto& [a, quorums] : compiledGraph.Quorums) {
+                    for (const auto& quorum : quorums) {
+                        for (const auto& b : quorum.Members) {
+                            // quorum would release such dependency early
+                            if ((plainTree.count(a) > 0) && (plainTree.at(a).count(b) > 0)) {
+                                std::cerr << graph.first << ": " << a << " depends on " << b
+                                          << " both unconditionally and via dependency group, which is wrong" << std::endl;
+                                return 1;
+                            }
+
+                            if (compiledGraph.Services.at(a).SendRawOutputOf == b) {
+                                std::cerr << graph.first << ": " << a << " could not have 'send_raw_output_of' = '"
+                                          << b << "', since it's a member of dependency group" << std::endl;
+                                return 1;
+                            }
+                        }
+                    }
                 }
 
                 compiledGraph.Tree = tree;
@@ -250,6 +466,15 @@ namespace NAC {
 #endif
 
                 for (auto&& [name, service] : compiledGraph.Services) {
+                    if (
+                        !service.MapOver.empty()
+                        && ((compiledGraph.Tree.count(name) == 0) || (compiledGraph.Tree[name].count(service.MapOver) == 0))
+                    ) {
+                        std::cerr << graph.first << ": service " << name << " is mapped over " << service.MapOver
+                                  << ", which is not its dependency" << std::endl;
+                        return 1;
+                    }
+
                     if (!service.SendRawOutputOf.empty()) {
                         if (
                             compiledGraph.Tree.count(name) == 0
@@ -273,10 +498,76 @@ namespace NAC {
                 }
 
             } else {
+                for (const auto& [name, service] : compiledGraph.Services) {
+                    if (!service.MapOver.empty()) {
+                        std::cerr << graph.first << ": service " << name << " is mapped over " << service.MapOver
+                                  << ", which is not its dependency" << std::endl;
+                        return 1;
+                    }
+                }
+
                 compiledGraph.Tree = tree;
             }
 
-            graphs.emplace(graph.first, TRouterDProxyHandler::TArgs{hosts, std::move(compiledGraph)});
+            if ((data.count("passthrough") > 0) && data["passthrough"].get<bool>()) {
+                if (
+                    (compiledGraph.Services.size() != 1)
+                    || (compiledGraph.Services.count("output") == 0)
+                    || (data.count("deps") > 0)
+                ) {
+                    std::cerr << graph.first << ": 'passthrough' graph should consist of 'output' service only" << std::endl;
+                    return 1;
+                }
+
+                const auto& service = compiledGraph.Services.at("output");
+
+                // Passthrough() uses only hosts group and path of the service
+                if (
+                    !service.SendRawOutputOf.empty()
+                    || !service.SaveAs.empty()
+                    || !service.Race.empty()
+                    || !service.MapOver.empty()
+                    || service.Cache
+                    || service.Coalescer
+                    || service.Batcher
+                ) {
+                    std::cerr << graph.first << ": 'passthrough' graph could not have 'send_raw_output_of', "
+                              << "'save_as', 'race', 'map', 'cache', 'coalesce' or 'batch' specified" << std::endl;
+                    return 1;
+                }
+
+                compiledGraph.Passthrough = true;
+            }
+
+            {
+                auto dependents = std::make_shared<TRouterDGraph::TTree>();
+
+                for (const auto& it : compiledGraph.ReverseTree) {
+                    auto&& out = (*dependents)[it.first];
+                    std::vector<std::string> queue(it.second.begin(), it.second.end());
+
+                    while (!queue.empty()) {
+                        const std::string name(std::move(queue.back()));
+                        queue.pop_back();
+
+                        if (!out.insert(name).second || (compiledGraph.ReverseTree.count(name) == 0)) {
+                            continue;
+                        }
+
+                        for (const auto& next : compiledGraph.ReverseTree.at(name)) {
+                            queue.push_back(next);
+                        }
+                    }
+                }
+
+                compiledGraph.Dependents = dependents;
+            }
+
+            if (data.count("timeout") > 0) {
+                compiledGraph.Timeout = data["timeout"].get<size_t>();
+            }
+
+            graphs.emplace(graph.first, TRouterDProxyHandler::TArgs{hosts, std::move(compiledGraph), deadlines});
         }
 
         std::set<size_t> responseTimeBuckets;
@@ -287,6 +578,23 @@ namespace NAC {
             }
         }
 
+        std::shared_ptr<TResponseCompressor> compressor;
+
+        if (config.count("response_compression") > 0) {
+            const auto& responseCompression = config["response_compression"];
+
+            if (responseCompression.count("encodings") > 0) {
+                for (const auto& encoding : responseCompression["encodings"].get<std::vector<std::string>>()) {
+                    if (!TResponseCompressor::IsSupported(encoding)) {
+                        std::cerr << "response_compression: unsupported encoding: " << encoding << std::endl;
+                        return 1;
+                    }
+                }
+            }
+
+            compressor = std::make_shared<TResponseCompressor>(TResponseCompressor::TArgs::FromConfig(config["response_compression"]));
+        }
+
         std::unordered_map<std::string, std::shared_ptr<TStatWriter>> statWriters;
         NHTTPRouter::TRouter router;
 
@@ -302,7 +610,24 @@ namespace NAC {
                 statWriters.emplace(name, new TStatWriter(responseTimeBuckets));
             }
 
-            router.Add(route["r"].get<std::string>(), std::make_shared<TRouterDProxyHandler>(graphs.at(graphName), statWriters.at(name)));
+            std::shared_ptr<TRouteCache> routeCache;
+
+            if (route.count("cache") > 0) {
+                const auto& cacheArgs = TRouteCache::TArgs::FromConfig(route["cache"]);
+                routeCache = std::make_shared<TRouteCache>(cacheArgs);
+
+                if (cacheArgs.Persistent) {
+                    if (!persistentCache) {
+                        std::cerr << name << ": route " << route["r"].get<std::string>() << " has persistent cache, "
+                                  << "but 'persistent_cache' is not configured" << std::endl;
+                        return 1;
+                    }
+
+                    routeCache->SetPersistent(persistentCache, "r:" + name + ":" + route["r"].get<std::string>() + ":");
+                }
+            }
+
+            router.Add(route["r"].get<std::string>(), std::make_shared<TRouterDProxyHandler>(graphs.at(graphName), statWriters.at(name), routeCache, compressor));
         }
 
         NHTTPRouter::TRouter intRouter;
@@ -321,6 +646,7 @@ namespace NAC {
         intServerArgs.ThreadCount = 1;
 
         intRouter.Add("^/stats/*$", std::make_shared<TRouterDStatHandler>(statWriters));
+        intRouter.Add("^/memory/*$", std::make_shared<TRouterDMemoryHandler>(TRouterDRequest::TArgs::FromConfig(config).MaxTotalMemory));
 
         NHTTPServer::TServer statServer(intServerArgs, intRouter);
 
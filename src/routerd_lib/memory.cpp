@@ -0,0 +1,57 @@
+#include "memory.hpp"
+
+namespace {
+    static std::atomic<size_t> InFlightRequests(0);
+    static std::atomic<size_t> TotalMemory(0);
+    static std::atomic<size_t> ShedOverTotalRequests(0);
+    static std::atomic<size_t> ShedOverRequestRequests(0);
+}
+
+namespace NAC {
+    TInFlightGuard::TInFlightGuard() {
+        ++InFlightRequests;
+    }
+
+    TInFlightGuard::~TInFlightGuard() {
+        --InFlightRequests;
+    }
+
+    size_t TInFlightGuard::Count() {
+        return InFlightRequests.load();
+    }
+
+    TMemoryUsage::TMemoryUsage()
+        : Held(std::make_shared<std::atomic<size_t>>(0))
+    {
+    }
+
+    std::shared_ptr<void> TMemoryUsage::Charge(size_t size) {
+        *Held += size;
+        TotalMemory += size;
+
+        return std::shared_ptr<void>(nullptr, [held = Held, size](void*) {
+            *held -= size;
+            TotalMemory -= size;
+        });
+    }
+
+    size_t TMemoryUsage::Total() {
+        return TotalMemory.load();
+    }
+
+    void TMemoryUsage::ShedOverTotal() {
+        ++ShedOverTotalRequests;
+    }
+
+    size_t TMemoryUsage::ShedOverTotalCount() {
+        return ShedOverTotalRequests.load();
+    }
+
+    void TMemoryUsage::ShedOverRequest() {
+        ++ShedOverRequestRequests;
+    }
+
+    size_t TMemoryUsage::ShedOverRequestCount() {
+        return ShedOverRequestRequests.load();
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+
+namespace NAC {
+    // Counts live TRouterDRequest objects.
+    class TInFlightGuard {
+    public:
+        TInFlightGuard();
+        TInFlightGuard(const TInFlightGuard&) = delete;
+        TInFlightGuard& operator=(const TInFlightGuard&) = delete;
+        ~TInFlightGuard();
+
+        static size_t Count();
+    };
+
+    // Bytes held on behalf of a single request. Usage of all live requests
+    // is summed up process-wide.
+    class TMemoryUsage {
+    public:
+        TMemoryUsage();
+        TMemoryUsage(const TMemoryUsage&) = delete;
+        TMemoryUsage& operator=(const TMemoryUsage&) = delete;
+
+        // Bytes are held until the returned guard is released, which could happen after the request ends,
+        // e.g. when the guard is memorized by a message which is still being written
+        std::shared_ptr<void> Charge(size_t size);
+
+        size_t Get() const {
+            return Held->load();
+        }
+
+        static size_t Total();
+
+        // Requests which were rejected before start, since all requests held too much
+        static void ShedOverTotal();
+        static size_t ShedOverTotalCount();
+
+        // Requests which were cancelled, since they held too much themselves
+        static void ShedOverRequest();
+        static size_t ShedOverRequestCount();
+
+    private:
+        std::shared_ptr<std::atomic<size_t>> Held;
+    };
+}
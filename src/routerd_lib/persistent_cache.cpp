@@ -0,0 +1,603 @@
+#include "persistent_cache.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <iostream>
+
+namespace {
+    // Record layout (native byte order, the file is not meant to be moved between hosts):
+    //
+    //   u32 magic, u32 key size, u64 value size, i64 expires (ms since epoch), u64 meta
+    //   key
+    //   value:
+    //     u32 first line size, first line
+    //     u64 status code
+    //     u8 multipart
+    //     u32 part count
+    //       u32 name size, name
+    //       u32 header count
+    //         u32 name size, name, u32 value size, value
+    //       u64 content size, content
+    static const uint32_t RecordMagic = 0x50524341; // "ACRP"
+    static const size_t RecordHeaderSize = 32;
+
+    template<typename T>
+    void PutValue(std::string& out, T value) {
+        out.append((const char*)&value, sizeof(value));
+    }
+
+    void PutString(std::string& out, const std::string& value) {
+        PutValue<uint32_t>(out, value.size());
+        out += value;
+    }
+
+    class TReader {
+    public:
+        TReader(const char* data, size_t size)
+            : Data(data)
+            , Size(size)
+        {
+        }
+
+        template<typename T>
+        bool Get(T& out) {
+            if (sizeof(T) > (Size - Pos)) {
+                return false;
+            }
+
+            memcpy(&out, Data + Pos, sizeof(T));
+            Pos += sizeof(T);
+
+            return true;
+        }
+
+        bool Bytes(uint64_t size, const char*& out) {
+            if (size > (Size - Pos)) {
+                return false;
+            }
+
+            out = Data + Pos;
+            Pos += size;
+
+            return true;
+        }
+
+        bool String(std::string& out) {
+            uint32_t size;
+            const char* data;
+
+            if (!Get(size) || !Bytes(size, data)) {
+                return false;
+            }
+
+            out.assign(data, size);
+
+            return true;
+        }
+
+    private:
+        const char* Data;
+        size_t Size;
+        size_t Pos = 0;
+    };
+
+    // keeps mapped file and parsed headers alive for TServiceReply
+    struct TRecordHolder {
+        std::shared_ptr<void> Mapping;
+        std::vector<NAC::NHTTPLikeParser::THeaders> Headers;
+    };
+
+    int64_t NowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            NAC::TPersistentCache::TClock::now().time_since_epoch()
+        ).count();
+    }
+}
+
+namespace NAC {
+    struct TPersistentCache::TMapping {
+        const char* Data = nullptr;
+        size_t Size = 0;
+
+        ~TMapping() {
+            if (Data) {
+                munmap((void*)Data, Size);
+            }
+        }
+    };
+
+    TPersistentCache::TArgs TPersistentCache::TArgs::FromConfig(const nlohmann::json& config) {
+        TArgs out;
+        out.Path = config["path"].get<std::string>();
+
+        if (config.count("max_size") > 0) {
+            out.MaxSize = config["max_size"].get<size_t>();
+        }
+
+        if (config.count("max_pending") > 0) {
+            out.MaxPending = config["max_pending"].get<size_t>();
+        }
+
+        return out;
+    }
+
+    TPersistentCache::TPersistentCache(const TArgs& args)
+        : Args(args)
+        , Loaded(false)
+    {
+        if (Open()) {
+            Loader = std::thread([this]() {
+                Load();
+            });
+
+            Writer = std::thread([this]() {
+                RunWriter();
+            });
+        }
+    }
+
+    TPersistentCache::~TPersistentCache() {
+        {
+            std::unique_lock<std::mutex> lock(QueueLock);
+            Stopped = true;
+        }
+
+        QueueWakeup.notify_one();
+
+        if (Writer.joinable()) {
+            Writer.join();
+        }
+
+        if (Loader.joinable()) {
+            Loader.join();
+        }
+
+        if (FD >= 0) {
+            close(FD);
+        }
+    }
+
+    bool TPersistentCache::Open() {
+        FD = open(Args.Path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (FD < 0) {
+            std::cerr << "persistent cache: failed to open " << Args.Path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        // truncation and compaction of the file would break records of another process
+        if (flock(FD, LOCK_EX | LOCK_NB) != 0) {
+            std::cerr << "persistent cache: " << Args.Path << " is used by another process ("
+                      << strerror(errno) << "), persistent cache is disabled" << std::endl;
+            close(FD);
+            FD = -1;
+            return false;
+        }
+
+        struct stat st;
+
+        if (fstat(FD, &st) != 0) {
+            std::cerr << "persistent cache: fstat() failed: " << strerror(errno) << std::endl;
+            close(FD);
+            FD = -1;
+            return false;
+        }
+
+        FileSize = st.st_size;
+
+        return Map(FileSize);
+    }
+
+    bool TPersistentCache::Map(uint64_t size) {
+        auto mapping = std::make_shared<TMapping>();
+
+        if (size > 0) {
+            void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, FD, 0);
+
+            if (data == MAP_FAILED) {
+                std::cerr << "persistent cache: mmap() failed: " << strerror(errno) << std::endl;
+                return false;
+            }
+
+            mapping->Data = (const char*)data;
+            mapping->Size = size;
+        }
+
+        // previous mapping stays alive while replies reference it
+        Mapping = std::move(mapping);
+
+        return true;
+    }
+
+    void TPersistentCache::Load() {
+        std::shared_ptr<TMapping> mapping;
+
+        {
+            std::lock_guard<std::mutex> guard(Lock);
+            mapping = Mapping;
+        }
+
+        const int64_t now(NowMs());
+        uint64_t offset(0);
+
+        while ((offset + RecordHeaderSize) <= mapping->Size) {
+            TReader reader(mapping->Data + offset, mapping->Size - offset);
+            uint32_t magic;
+            uint32_t keySize;
+            uint64_t valueSize;
+            int64_t expires;
+            uint64_t meta;
+            const char* key;
+            const char* value;
+
+            if (
+                !reader.Get(magic)
+                || (magic != RecordMagic)
+                || !reader.Get(keySize)
+                || !reader.Get(valueSize)
+                || !reader.Get(expires)
+                || !reader.Get(meta)
+                || !reader.Bytes(keySize, key)
+                || !reader.Bytes(valueSize, value)
+            ) {
+                break;
+            }
+
+            const uint64_t size(RecordHeaderSize + keySize + valueSize);
+
+            if (expires > now) {
+                Index[std::string(key, keySize)] = TIndexEntry {
+                    .Offset = offset,
+                    .Size = size,
+                    .Expires = expires
+                };
+
+            } else {
+                Index.erase(std::string(key, keySize));
+            }
+
+            offset += size;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(Lock);
+
+            if (offset < FileSize) {
+                // unfinished record at the end, most likely after a crash
+                std::cerr << "persistent cache: truncating " << Args.Path << " at " << offset << std::endl;
+
+                if (ftruncate(FD, offset) == 0) {
+                    FileSize = offset;
+                }
+            }
+
+            std::cerr << "persistent cache: loaded " << Index.size() << " entries from " << Args.Path << std::endl;
+        }
+
+        Loaded = true;
+    }
+
+    std::shared_ptr<const TServiceReply> TPersistentCache::Get(
+        const std::string& key,
+        TClock::time_point* expires,
+        uint64_t* meta
+    ) {
+        if (!Loaded) {
+            return std::shared_ptr<const TServiceReply>();
+        }
+
+        std::shared_ptr<TMapping> mapping;
+        TIndexEntry entry;
+
+        {
+            std::lock_guard<std::mutex> guard(Lock);
+            const auto& it = Index.find(key);
+
+            if (it == Index.end()) {
+                return std::shared_ptr<const TServiceReply>();
+            }
+
+            if (it->second.Expires <= NowMs()) {
+                Index.erase(it);
+                return std::shared_ptr<const TServiceReply>();
+            }
+
+            entry = it->second;
+
+            if (!Mapping || ((entry.Offset + entry.Size) > Mapping->Size)) {
+                if (!Map(FileSize)) {
+                    return std::shared_ptr<const TServiceReply>();
+                }
+            }
+
+            mapping = Mapping;
+        }
+
+        TReader reader(mapping->Data + entry.Offset, entry.Size);
+        uint32_t magic;
+        uint32_t keySize;
+        uint64_t valueSize;
+        int64_t expires_;
+        uint64_t meta_;
+        const char* key_;
+        auto holder = std::make_shared<TRecordHolder>();
+        auto out = std::make_shared<TServiceReply>();
+        uint8_t multipart;
+        uint32_t partCount;
+
+        if (
+            !reader.Get(magic)
+            || (magic != RecordMagic)
+            || !reader.Get(keySize)
+            || !reader.Get(valueSize)
+            || !reader.Get(expires_)
+            || !reader.Get(meta_)
+            || !reader.Bytes(keySize, key_)
+            || (key != std::string(key_, keySize))
+            || !reader.String(out->FirstLine)
+            || !reader.Get(out->StatusCode)
+            || !reader.Get(multipart)
+            || !reader.Get(partCount)
+        ) {
+            return std::shared_ptr<const TServiceReply>();
+        }
+
+        holder->Mapping = mapping;
+        holder->Headers.resize(partCount); // parts point into it, so no reallocations later
+        out->Multipart = (multipart != 0);
+        out->Size = sizeof(TServiceReply) + out->FirstLine.size();
+
+        for (uint32_t i = 0; i < partCount; ++i) {
+            std::string name;
+            uint32_t headerCount;
+            uint64_t contentLength;
+            const char* content;
+            auto&& headers = holder->Headers[i];
+
+            if (!reader.String(name) || !reader.Get(headerCount)) {
+                return std::shared_ptr<const TServiceReply>();
+            }
+
+            for (uint32_t j = 0; j < headerCount; ++j) {
+                std::string headerName;
+                std::string headerValue;
+
+                if (!reader.String(headerName) || !reader.String(headerValue)) {
+                    return std::shared_ptr<const TServiceReply>();
+                }
+
+                headers[headerName].push_back(std::move(headerValue));
+            }
+
+            if (!reader.Get(contentLength) || !reader.Bytes(contentLength, content)) {
+                return std::shared_ptr<const TServiceReply>();
+            }
+
+            out->AddPart(std::move(name), TServiceReplyPart(headers, content, contentLength));
+        }
+
+        out->Holder = holder;
+
+        if (expires) {
+            *expires = TClock::time_point(std::chrono::milliseconds(entry.Expires));
+        }
+
+        if (meta) {
+            *meta = meta_;
+        }
+
+        return out;
+    }
+
+    void TPersistentCache::Put(
+        const std::string& key,
+        const TServiceReply& reply,
+        TClock::time_point expires,
+        uint64_t meta
+    ) {
+        if (!Loaded) {
+            return;
+        }
+
+        std::string value;
+
+        PutString(value, reply.FirstLine);
+        PutValue<uint64_t>(value, reply.StatusCode);
+        PutValue<uint8_t>(value, (reply.Multipart ? 1 : 0));
+        PutValue<uint32_t>(value, reply.Parts.size());
+
+        for (const auto& part : reply.Parts) {
+            size_t headerCount(0);
+
+            for (const auto& header : *part.Part.Headers) {
+                headerCount += header.second.size();
+            }
+
+            PutString(value, part.Name);
+            PutValue<uint32_t>(value, headerCount);
+
+            for (const auto& header : *part.Part.Headers) {
+                for (const auto& headerValue : header.second) {
+                    PutString(value, header.first);
+                    PutString(value, headerValue);
+                }
+            }
+
+            PutValue<uint64_t>(value, part.Part.ContentLength);
+            value.append(part.Part.Content, part.Part.ContentLength);
+        }
+
+        const int64_t expiresMs(std::chrono::duration_cast<std::chrono::milliseconds>(expires.time_since_epoch()).count());
+        std::string record;
+
+        record.reserve(RecordHeaderSize + key.size() + value.size());
+        PutValue<uint32_t>(record, RecordMagic);
+        PutValue<uint32_t>(record, key.size());
+        PutValue<uint64_t>(record, value.size());
+        PutValue<int64_t>(record, expiresMs);
+        PutValue<uint64_t>(record, meta);
+        record += key;
+        record += value;
+
+        if (record.size() > (Args.MaxSize / 2)) {
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(QueueLock);
+
+            if ((QueueSize + record.size()) > Args.MaxPending) {
+                return; // disk does not keep up, the reply is still cached in memory
+            }
+
+            QueueSize += record.size();
+            Queue.push_back(TRecord {
+                .Key = key,
+                .Data = std::move(record),
+                .Expires = expiresMs
+            });
+        }
+
+        QueueWakeup.notify_one();
+    }
+
+    void TPersistentCache::RunWriter() {
+        std::unique_lock<std::mutex> lock(QueueLock);
+
+        while (true) {
+            if (Queue.empty()) {
+                if (Stopped) {
+                    break;
+                }
+
+                QueueWakeup.wait(lock);
+                continue;
+            }
+
+            TRecord record(std::move(Queue.front()));
+            Queue.pop_front();
+            QueueSize -= record.Data.size();
+
+            lock.unlock();
+            Write(record);
+            lock.lock();
+        }
+    }
+
+    // FD and FileSize are only changed by the writer thread, so it uses them without the lock
+    void TPersistentCache::Write(const TRecord& record) {
+        if ((FileSize + record.Data.size()) > Args.MaxSize) {
+            Compact();
+        }
+
+        size_t written(0);
+
+        while (written < record.Data.size()) {
+            const ssize_t rv(pwrite(FD, record.Data.data() + written, record.Data.size() - written, FileSize + written));
+
+            if (rv < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                std::cerr << "persistent cache: write failed: " << strerror(errno) << std::endl;
+
+                if (ftruncate(FD, FileSize) != 0) {
+                    std::cerr << "persistent cache: ftruncate() failed: " << strerror(errno) << std::endl;
+                }
+
+                return;
+            }
+
+            written += rv;
+        }
+
+        std::lock_guard<std::mutex> guard(Lock);
+
+        Index[record.Key] = TIndexEntry {
+            .Offset = FileSize,
+            .Size = record.Data.size(),
+            .Expires = record.Expires
+        };
+
+        FileSize += record.Data.size();
+    }
+
+    void TPersistentCache::Compact() {
+        std::shared_ptr<TMapping> mapping;
+        std::unordered_map<std::string, TIndexEntry> live;
+
+        {
+            // records are copied without the lock, so that Get() is not blocked meanwhile
+            std::lock_guard<std::mutex> guard(Lock);
+
+            if ((!Mapping || (Mapping->Size < FileSize)) && !Map(FileSize)) {
+                return;
+            }
+
+            mapping = Mapping;
+            live = Index;
+        }
+
+        const std::string tmpPath(Args.Path + ".tmp");
+        const int fd(open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+
+        if (fd < 0) {
+            std::cerr << "persistent cache: failed to open " << tmpPath << ": " << strerror(errno) << std::endl;
+            return;
+        }
+
+        // new file replaces the locked one, so it should be locked before it's visible
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            std::cerr << "persistent cache: failed to lock " << tmpPath << ": " << strerror(errno) << std::endl;
+            close(fd);
+            return;
+        }
+
+        const int64_t now(NowMs());
+        std::unordered_map<std::string, TIndexEntry> index;
+        uint64_t size(0);
+
+        // keep at most a half, so that compaction does not happen on every write
+        for (const auto& it : live) {
+            if ((it.second.Expires <= now) || ((size + it.second.Size) > (Args.MaxSize / 2))) {
+                continue;
+            }
+
+            if (pwrite(fd, mapping->Data + it.second.Offset, it.second.Size, size) != (ssize_t)it.second.Size) {
+                std::cerr << "persistent cache: compaction failed: " << strerror(errno) << std::endl;
+                close(fd);
+                unlink(tmpPath.c_str());
+                return;
+            }
+
+            index[it.first] = TIndexEntry {
+                .Offset = size,
+                .Size = it.second.Size,
+                .Expires = it.second.Expires
+            };
+
+            size += it.second.Size;
+        }
+
+        if (rename(tmpPath.c_str(), Args.Path.c_str()) != 0) {
+            std::cerr << "persistent cache: rename failed: " << strerror(errno) << std::endl;
+            close(fd);
+            unlink(tmpPath.c_str());
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard(Lock);
+
+        close(FD);
+        FD = fd;
+        FileSize = size;
+        Index.swap(index);
+        Map(FileSize);
+    }
+}
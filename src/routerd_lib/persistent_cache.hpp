@@ -0,0 +1,94 @@
+#pragma once
+
+#include "reply.hpp"
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <deque>
+#include <condition_variable>
+#include <json.hh>
+#include <stdint.h>
+
+namespace NAC {
+    // Reply cache, which survives restarts: an append-only file of records,
+    // which is mmap'ed for reading, and a hashed in-memory index of it,
+    // which is built in background on startup. Records are never modified:
+    // when the file grows too big, live records are copied to a new file.
+    // Records are written, and the file is compacted, by a thread of its own.
+    // The file is locked, so that only one process uses it.
+    class TPersistentCache {
+    public:
+        using TClock = std::chrono::system_clock;
+
+        struct TArgs {
+            std::string Path;
+            size_t MaxSize = 1024 * 1024 * 1024;
+            size_t MaxPending = 64 * 1024 * 1024; // bytes of records waiting to be written, the rest are dropped
+
+            static TArgs FromConfig(const nlohmann::json&);
+        };
+
+    public:
+        TPersistentCache(const TArgs& args);
+        ~TPersistentCache();
+
+        // Bodies of the returned reply point into the mapped file.
+        // Meta is an opaque value stored along with the reply.
+        std::shared_ptr<const TServiceReply> Get(
+            const std::string& key,
+            TClock::time_point* expires = nullptr,
+            uint64_t* meta = nullptr
+        );
+
+        // Record is copied and written in background
+        void Put(
+            const std::string& key,
+            const TServiceReply& reply,
+            TClock::time_point expires,
+            uint64_t meta = 0
+        );
+
+    private:
+        struct TMapping;
+
+        struct TIndexEntry {
+            uint64_t Offset = 0;
+            uint64_t Size = 0;
+            int64_t Expires = 0; // ms since epoch
+        };
+
+        struct TRecord {
+            std::string Key;
+            std::string Data;
+            int64_t Expires = 0; // ms since epoch
+        };
+
+    private:
+        bool Open();
+        void Load();
+        bool Map(uint64_t size);
+        void Write(const TRecord& record);
+        void Compact();
+        void RunWriter();
+
+    private:
+        TArgs Args;
+        std::mutex Lock;
+        int FD = -1;
+        uint64_t FileSize = 0;
+        std::shared_ptr<TMapping> Mapping;
+        std::unordered_map<std::string, TIndexEntry> Index;
+        std::atomic<bool> Loaded;
+        std::thread Loader;
+        std::mutex QueueLock;
+        std::condition_variable QueueWakeup;
+        std::deque<TRecord> Queue;
+        size_t QueueSize = 0;
+        bool Stopped = false;
+        std::thread Writer;
+    };
+}
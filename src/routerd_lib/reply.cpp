@@ -0,0 +1,215 @@
+#include "reply.hpp"
+#include "frames.hpp"
+#include "compress.hpp"
+#include <ac-common/str.hpp>
+#include <deque>
+#include <iostream>
+
+namespace {
+    struct TFramesHolder {
+        std::shared_ptr<NAC::NHTTP::TIncomingResponse> Response;
+        std::vector<NAC::TFramesPart> Frames;
+    };
+
+    struct TCopyHolder {
+        std::shared_ptr<void> Base;
+        std::deque<NAC::NHTTPLikeParser::THeaders> Headers;
+        std::deque<std::string> Bodies;
+        std::vector<std::shared_ptr<NAC::TSharedPayload>> Payloads;
+    };
+
+    std::shared_ptr<const NAC::TServiceReply> Parse(std::shared_ptr<NAC::NHTTP::TIncomingResponse> response) {
+        using namespace NAC;
+
+        auto out = std::make_shared<TServiceReply>();
+        out->FirstLine = response->FirstLine();
+        out->StatusCode = response->StatusCode();
+        out->Size = sizeof(TServiceReply) + out->FirstLine.size();
+
+        if (response->ContentType() == std::string("multipart/x-ac-routerd")) {
+            out->Holder = response;
+            out->Multipart = true;
+
+            for (const auto& part : response->Parts()) {
+                std::string partName;
+                NStringUtils::Strip(part.ContentDispositionParams().at("filename"), partName, 2, "\"'");
+
+                out->AddPart(std::move(partName), part);
+            }
+
+            return out;
+        }
+
+        if (response->ContentType() == FramesContentType) {
+            auto holder = std::make_shared<TFramesHolder>();
+            holder->Response = response;
+
+            if (!ParseFrames(response->Content(), response->ContentLength(), holder->Frames)) {
+                std::cerr << "malformed frames reply" << std::endl;
+                return std::shared_ptr<const TServiceReply>();
+            }
+
+            out->Holder = holder;
+            out->Multipart = true;
+
+            for (const auto& part : holder->Frames) {
+                out->AddPart(std::string(part.Name), TServiceReplyPart(part.Headers, part.Content, part.ContentLength));
+            }
+
+            return out;
+        }
+
+        out->Holder = response;
+        out->AddPart(std::string(), *response);
+
+        return out;
+    }
+
+    std::shared_ptr<const NAC::TServiceReply> Decode(std::shared_ptr<const NAC::TServiceReply> reply, size_t maxSize) {
+        using namespace NAC;
+
+        if (!reply) {
+            return reply;
+        }
+
+        bool encoded(false);
+
+        for (const auto& part : reply->Parts) {
+            if (!part.Part.HeaderValue("x-ac-routerd-encoding").empty()) {
+                encoded = true;
+                break;
+            }
+        }
+
+        if (!encoded) {
+            return reply;
+        }
+
+        auto holder = std::make_shared<TCopyHolder>();
+        holder->Base = reply->Holder; // bodies of parts which were not compressed
+        auto out = std::make_shared<TServiceReply>();
+        out->FirstLine = reply->FirstLine;
+        out->StatusCode = reply->StatusCode;
+        out->Multipart = reply->Multipart;
+        out->Size = sizeof(TServiceReply) + out->FirstLine.size();
+
+        for (const auto& part : reply->Parts) {
+            const auto& encoding = part.Part.HeaderValue("x-ac-routerd-encoding");
+
+            if (encoding.empty()) {
+                out->AddPart(std::string(part.Name), part.Part);
+                continue;
+            }
+
+            holder->Bodies.emplace_back();
+            auto& body = holder->Bodies.back();
+
+            if (
+                (encoding != std::string("zstd"))
+                || !DecompressZstd(part.Part.Content, part.Part.ContentLength, maxSize, body)
+            ) {
+                std::cerr << "failed to decode part " << part.Name << " (" << encoding << ")" << std::endl;
+                return std::shared_ptr<const TServiceReply>();
+            }
+
+            holder->Headers.push_back(*part.Part.Headers);
+            auto& headers = holder->Headers.back();
+            headers.erase("x-ac-routerd-encoding");
+
+            auto compressed = std::make_shared<const std::string>(part.Part.Content, part.Part.ContentLength);
+            out->Size += compressed->size();
+            out->Compressed[body.data()] = std::move(compressed);
+
+            out->AddPart(std::string(part.Name), TServiceReplyPart(headers, body.data(), body.size()));
+        }
+
+        out->Holder = std::move(holder);
+
+        return out;
+    }
+}
+
+namespace NAC {
+    std::shared_ptr<const TServiceReply> TServiceReply::FromResponse(
+        std::shared_ptr<NHTTP::TIncomingResponse> response,
+        const TServiceHostsGroup& group
+    ) {
+        return Spill(Decode(Parse(std::move(response)), group.MaxDecompressedSize), group.SpillThreshold);
+    }
+
+    std::shared_ptr<const TServiceReply> TServiceReply::Spill(
+        std::shared_ptr<const TServiceReply> reply,
+        size_t threshold
+    ) {
+        if (!reply || (threshold == 0)) {
+            return reply;
+        }
+
+        bool spill(false);
+
+        for (const auto& part : reply->Parts) {
+            if (part.Part.ContentLength >= threshold) {
+                spill = true;
+                break;
+            }
+        }
+
+        if (!spill) {
+            return reply;
+        }
+
+        // headers and small bodies are copied, so that nothing refers to the original holder
+        auto holder = std::make_shared<TCopyHolder>();
+        auto out = std::make_shared<TServiceReply>();
+        out->FirstLine = reply->FirstLine;
+        out->StatusCode = reply->StatusCode;
+        out->Multipart = reply->Multipart;
+        out->Size = sizeof(TServiceReply) + out->FirstLine.size();
+
+        for (const auto& part : reply->Parts) {
+            holder->Headers.push_back(*part.Part.Headers);
+            const auto& headers = holder->Headers.back();
+
+            if (part.Part.ContentLength >= threshold) {
+                auto payload = TSharedPayload::Create(part.Part.Content, part.Part.ContentLength);
+
+                if (!payload || !payload->Map()) {
+                    return reply;
+                }
+
+                out->AddPart(std::string(part.Name), TServiceReplyPart(headers, payload->Data(), payload->Size()));
+                holder->Payloads.push_back(std::move(payload));
+
+            } else {
+                holder->Bodies.emplace_back(part.Part.Content, part.Part.ContentLength);
+                const auto& body = holder->Bodies.back();
+
+                out->AddPart(std::string(part.Name), TServiceReplyPart(headers, body.data(), body.size()));
+            }
+
+            const auto& compressed = reply->Compressed.find(part.Part.Content);
+
+            if (compressed != reply->Compressed.end()) {
+                out->Compressed[out->Parts.back().Part.Content] = compressed->second;
+                out->Size += compressed->second->size();
+            }
+        }
+
+        out->Payloads = holder->Payloads;
+        out->Holder = std::move(holder);
+
+        return out;
+    }
+
+    void TServiceReply::AddPart(std::string&& name, const TServiceReplyPart& part) {
+        Size += sizeof(TNamedPart) + name.size() + part.ContentLength;
+
+        for (const auto& header : *part.Headers) {
+            for (const auto& value : header.second) {
+                Size += header.first.size() + value.size();
+            }
+        }
+
+        Parts.push_back(TNamedPart{std::move(name), part});
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "shm.hpp"
+#include "structs.hpp"
+#include <ac-library/http/abstract_message.hpp>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+namespace NAC {
+    // Headers and body of a single part of service's reply,
+    // regardless of how the reply was framed.
+    struct TServiceReplyPart {
+        const NHTTPLikeParser::THeaders* Headers = nullptr;
+        const char* Content = nullptr;
+        size_t ContentLength = 0;
+
+        TServiceReplyPart() = default;
+
+        TServiceReplyPart(const NHTTP::TAbstractMessage& message)
+            : Headers(&message.Headers())
+            , Content(message.Content())
+            , ContentLength(message.ContentLength())
+        {
+        }
+
+        TServiceReplyPart(const NHTTPLikeParser::THeaders& headers, const char* content, size_t contentLength)
+            : Headers(&headers)
+            , Content(content)
+            , ContentLength(contentLength)
+        {
+        }
+
+        const std::string& HeaderValue(const std::string& name) const {
+            static const std::string empty;
+            const auto& it = Headers->find(name);
+
+            if ((it == Headers->end()) || it->second.empty()) {
+                return empty;
+            }
+
+            return it->second.front();
+        }
+    };
+
+    // Whole reply of a service. Immutable once built, so it could be
+    // shared between requests.
+    struct TServiceReply {
+        struct TNamedPart {
+            std::string Name;
+            TServiceReplyPart Part;
+        };
+
+        std::shared_ptr<void> Holder; // owns memory referenced by Parts
+        std::string FirstLine;
+        size_t StatusCode = 0;
+        bool Multipart = false; // parts are named by service, as in multipart/x-ac-routerd
+        std::vector<TNamedPart> Parts; // single unnamed part if not Multipart
+        size_t Size = 0; // approximate memory usage
+        std::vector<std::shared_ptr<TSharedPayload>> Payloads; // bodies of spilled parts
+        std::unordered_map<const char*, std::shared_ptr<const std::string>> Compressed; // zstd bodies as sent by service, by body
+
+        // Parts with X-AC-RouterD-Encoding header are decompressed. Bodies of parts of
+        // at least group.SpillThreshold bytes (if it's not zero) are moved off the heap
+        // into memfds, and the response itself is freed. Returns null if the reply
+        // could not be parsed or decoded, which means that the service has failed.
+        static std::shared_ptr<const TServiceReply> FromResponse(
+            std::shared_ptr<NHTTP::TIncomingResponse> response,
+            const TServiceHostsGroup& group
+        );
+
+        static std::shared_ptr<const TServiceReply> Spill(
+            std::shared_ptr<const TServiceReply> reply,
+            size_t threshold
+        );
+
+        void AddPart(std::string&& name, const TServiceReplyPart& part);
+    };
+}
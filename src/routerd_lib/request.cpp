@@ -1,6 +1,9 @@
 #include "request.hpp"
 #include <ac-common/str.hpp>
 #include "utils.hpp"
+#include "frames.hpp"
+#include "compress.hpp"
+#include "coalesce.hpp"
 #include <string.h>
 #include <pcrecpp.h>
 
@@ -12,9 +15,56 @@ namespace NAC {
             out.AllowNestedRequests = config["allow_nested_requests"].get<bool>();
         }
 
+        if (config.count("max_request_memory") > 0) {
+            out.MaxMemory = config["max_request_memory"].get<size_t>();
+        }
+
+        if (config.count("max_total_memory") > 0) {
+            out.MaxTotalMemory = config["max_total_memory"].get<size_t>();
+        }
+
         return out;
     }
 
+    void TRouterDRequest::Cancel() {
+        Cancelled = true;
+
+        std::vector<std::weak_ptr<NHTTPServer::TClientBase>> upstreams;
+
+        {
+            NUtils::TSpinLockGuard guard(UpstreamsLock);
+            upstreams.swap(Upstreams);
+        }
+
+        for (const auto& it : upstreams) {
+            if (auto client = it.lock()) {
+                client->Drop();
+            }
+        }
+
+        // dropped calls never reply, so requests which wait for them would hang
+        for (auto&& [coalescer, key] : LedCalls) {
+            Defer([coalescer = std::move(coalescer), key = std::move(key), this]() {
+                coalescer->Abandon(key, this);
+            });
+        }
+
+        LedCalls.clear();
+    }
+
+    void TRouterDRequest::AddUpstream(const std::shared_ptr<NHTTPServer::TClientBase>& client) {
+        {
+            NUtils::TSpinLockGuard guard(UpstreamsLock);
+
+            if (!Cancelled) {
+                Upstreams.push_back(client);
+                return;
+            }
+        }
+
+        client->Drop();
+    }
+
     NHTTP::TResponse TRouterDRequest::PreparePart(const std::string& partName) const {
         NHTTP::TResponse out;
         out.Header("Content-Disposition", "form-data; name=\"" + partName + "\"; filename=\"" + partName + "\"");
@@ -25,6 +75,118 @@ namespace NAC {
 
     void TRouterDRequest::AddPart(NHTTP::TResponse&& part) {
         Out().AddPart(std::move(part));
+        PartInfos.emplace_back();
+    }
+
+    void TRouterDRequest::AddPart(
+        NHTTP::TResponse&& part,
+        const std::string& name,
+        const std::string& producer,
+        std::shared_ptr<void> holder
+    ) {
+        Out().AddPart(std::move(part));
+        PartInfos.push_back(TPartInfo{name, producer, std::move(holder)});
+    }
+
+    void TRouterDRequest::AccountMemory(size_t size, const std::shared_ptr<void>& holder) {
+        auto charge = MemoryUsage.Charge(size);
+
+        NUtils::TSpinLockGuard guard(ChargesLock);
+        Charges[holder.get()].push_back(std::move(charge));
+    }
+
+    void TRouterDRequest::ReleaseParts(const std::function<bool(const std::string& name, const std::string& producer)>& isDead) {
+        const auto& base = Out();
+        std::vector<bool> keep(PartInfos.size(), true);
+        bool releasing(false);
+
+        for (size_t i = 0; i < PartInfos.size(); ++i) {
+            const auto& info = PartInfos.at(i);
+
+            if (!info.Producer.empty() && isDead(info.Name, info.Producer)) {
+                keep[i] = false;
+                releasing = true;
+            }
+        }
+
+        if (!releasing) {
+            return;
+        }
+
+        // messages which are still being written have memorized holders on their own
+        NHTTP::TResponse out;
+        std::vector<TPartInfo> partInfos;
+        std::unordered_set<const void*> releasedHolders;
+
+        out.FirstLine(base.FirstLine());
+
+        for (const auto& baseHeader : base.Headers()) {
+            AddHeader(baseHeader, out);
+        }
+
+        for (size_t i = 0; i < PartInfos.size(); ++i) {
+            const auto& basePart = base.Parts().at(i);
+
+            if (!keep[i]) {
+#ifdef AC_DEBUG_ROUTERD_PROXY
+                std::cerr << "releasing part " << PartInfos.at(i).Name << std::endl;
+#endif
+                // the buffer could be freed now, and its address reused by another body
+                const auto& payload = SharedPayloads.find(std::make_pair(basePart.Content(), basePart.ContentLength()));
+
+                if (payload != SharedPayloads.end()) {
+                    RetiredPayloads.push_back(std::move(payload->second)); // services could still be reading it
+                    SharedPayloads.erase(payload);
+                }
+
+                // messages which are still being written have memorized compressed bodies they use
+                CompressedBodies.erase(std::make_pair(basePart.Content(), basePart.ContentLength()));
+                releasedHolders.insert(PartInfos.at(i).Holder.get());
+
+                continue;
+            }
+
+            NHTTP::TResponse part;
+
+            if (basePart.ContentLength() > 0) {
+                part.Wrap(basePart.ContentLength(), basePart.Content());
+            }
+
+            for (const auto& baseHeader : basePart.Headers()) {
+                AddHeader(baseHeader, part);
+            }
+
+            out.AddPart(std::move(part));
+            partInfos.push_back(std::move(PartInfos.at(i)));
+        }
+
+        OutgoingRequest_ = std::move(out);
+        PartInfos = std::move(partInfos);
+
+        // reply is not held by the request anymore once none of its parts are left
+        for (const auto& info : PartInfos) {
+            releasedHolders.erase(info.Holder.get());
+        }
+
+        releasedHolders.erase(nullptr);
+
+        NUtils::TSpinLockGuard guard(ChargesLock);
+
+        for (const auto& holder : releasedHolders) {
+            Charges.erase(holder);
+        }
+    }
+
+    std::shared_ptr<void> TRouterDRequest::PartHolders() const {
+        auto out = std::make_shared<std::vector<std::shared_ptr<void>>>();
+
+        for (const auto& info : PartInfos) {
+            if (info.Holder) {
+                out->push_back(info.Holder);
+            }
+        }
+
+        return out;
     }
 
     NHTTP::TResponse& TRouterDRequest::Out() {
@@ -42,7 +204,13 @@ namespace NAC {
 
         const bool isNested(Args.AllowNestedRequests && !HeaderValue("x-ac-routerd").empty() && !Parts().empty());
 
+        const auto& hopByHopHeaders = HopByHopHeaders(Headers());
+
         for (const auto& header : Headers()) {
+            if (hopByHopHeaders.count(header.first) > 0) {
+                continue;
+            }
+
             if (isNested) {
                 if (
                     (header.first == std::string("content-type"))
@@ -102,9 +270,13 @@ namespace NAC {
         return OutgoingRequest_;
     }
 
-    TBlobSequence TRouterDRequest::OutgoingRequest(const std::string& path_, const std::vector<std::string>& args) {
+    std::string TRouterDRequest::RewriteFirstLine(
+        const std::string& base,
+        const std::string& path_,
+        const std::vector<std::string>& args
+    ) {
         if (path_.empty()) {
-            return (TBlobSequence)Out();
+            return base;
         }
 
         std::string path(path_);
@@ -118,41 +290,124 @@ namespace NAC {
             ).GlobalReplace(args.at(i), &path);
         }
 
-        const auto& base = Out();
-        NHTTP::TResponse out;
+        const auto& firstLineParts = NStringUtils::Split(base, ' ');
 
-        {
-            const auto& firstLineParts = NStringUtils::Split(base.FirstLine(), ' ');
+        if (firstLineParts.size() < 2) {
+            return base;
+        }
 
-            if (firstLineParts.size() > 1) {
-                const auto& pathParts = NStringUtils::Split(firstLineParts.at(1), '?');
-                std::string firstLine((std::string)firstLineParts.at(0) + " " + path);
+        const auto& pathParts = NStringUtils::Split(firstLineParts.at(1), '?');
+        std::string firstLine((std::string)firstLineParts.at(0) + " " + path);
 
-                for (size_t i = 1; i < pathParts.size(); ++i) {
-                    firstLine += "?" + (std::string)pathParts.at(i);
-                }
+        for (size_t i = 1; i < pathParts.size(); ++i) {
+            firstLine += "?" + (std::string)pathParts.at(i);
+        }
 
-                for (size_t i = 2; i < firstLineParts.size(); ++i) {
-                    firstLine += " " + (std::string)firstLineParts.at(i);
-                }
+        for (size_t i = 2; i < firstLineParts.size(); ++i) {
+            firstLine += " " + (std::string)firstLineParts.at(i);
+        }
 
-                out.FirstLine(std::move(firstLine));
+        return firstLine;
+    }
 
-            } else {
-                out.FirstLine(base.FirstLine());
-            }
+    std::shared_ptr<TSharedPayload> TRouterDRequest::SharedPayload(const char* data, size_t size) {
+        auto&& payload = SharedPayloads[std::make_pair(data, size)];
+
+        if (!payload) {
+            payload = TSharedPayload::Create(data, size);
+        }
+
+        return payload;
+    }
+
+    void TRouterDRequest::AddSharedPayloads(const std::vector<std::shared_ptr<TSharedPayload>>& payloads) {
+        for (const auto& payload : payloads) {
+            SharedPayloads[std::make_pair(payload->Data(), payload->Size())] = payload;
+        }
+    }
+
+    std::shared_ptr<const std::string> TRouterDRequest::CompressedBody(const char* data, size_t size, int level) {
+        auto&& body = CompressedBodies[std::make_pair(data, size)];
+
+        if (body.Received) {
+            return body.Received;
+        }
+
+        const auto& it = body.ByLevel.find(level);
+
+        if (it != body.ByLevel.end()) {
+            return it->second;
+        }
+
+        auto&& out = body.ByLevel[level];
+        auto compressed = std::make_shared<std::string>();
+
+        if (CompressZstd(data, size, level, *compressed) && (compressed->size() < size)) {
+            // charged for as long as the entry or messages which have memorized it hold it
+            auto charge = MemoryUsage.Charge(compressed->size());
+            auto holder = std::make_shared<std::pair<std::string, std::shared_ptr<void>>>(std::move(*compressed), std::move(charge));
+            out = std::shared_ptr<const std::string>(holder, &holder->first);
         }
 
+        return out;
+    }
+
+    void TRouterDRequest::AddCompressedBody(const char* data, size_t size, std::shared_ptr<const std::string> compressed) {
+        CompressedBodies[std::make_pair(data, size)].Received = std::move(compressed);
+    }
+
+    TBlobSequence TRouterDRequest::OutgoingRequest(
+        const std::string& path,
+        const std::vector<std::string>& args,
+        const TServiceHostsGroup& group
+    ) {
+        if (path.empty() && (group.ShmThreshold == 0) && !group.Zstd) {
+            auto msg = (TBlobSequence)Out();
+            msg.Memorize(PartHolders());
+
+            return msg;
+        }
+
+        const auto& base = Out();
+        NHTTP::TResponse out;
+
+        out.FirstLine(RewriteFirstLine(base.FirstLine(), path, args));
+
         for (const auto& baseHeader : base.Headers()) {
             for (const auto& value : baseHeader.second) {
                 out.Header(baseHeader.first, value);
             }
         }
 
+        if (group.Zstd) {
+            out.Header("X-AC-RouterD-Accept-Encoding", "zstd");
+        }
+
+        auto compressedBodies = std::make_shared<std::vector<std::shared_ptr<const std::string>>>();
+
         for (const auto& basePart : base.Parts()) {
             NHTTP::TResponse part;
+            std::shared_ptr<TSharedPayload> payload;
+            std::shared_ptr<const std::string> compressed;
 
-            if (basePart.ContentLength() > 0) {
+            if ((group.ShmThreshold > 0) && (basePart.ContentLength() >= group.ShmThreshold)) {
+                payload = SharedPayload(basePart.Content(), basePart.ContentLength());
+            }
+
+            if (!payload && group.Zstd && (basePart.ContentLength() >= group.CompressionMinSize) && (basePart.ContentLength() > 0)) {
+                compressed = CompressedBody(basePart.Content(), basePart.ContentLength(), group.CompressionLevel);
+            }
+
+            if (payload) {
+                part.Header("X-AC-RouterD-Shm", payload->Path());
+                part.Header("X-AC-RouterD-Shm-Length", std::to_string(payload->Size()));
+
+            } else if (compressed) {
+                part.Header("X-AC-RouterD-Encoding", "zstd");
+                part.Wrap(compressed->size(), compressed->data());
+                compressedBodies->push_back(compressed);
+
+            } else if (basePart.ContentLength() > 0) {
                 part.Wrap(basePart.ContentLength(), basePart.Content());
             }
 
@@ -165,6 +420,217 @@ namespace NAC {
             out.AddPart(std::move(part));
         }
 
+        auto msg = (TBlobSequence)out;
+        msg.Memorize(PartHolders());
+        msg.Memorize(compressedBodies);
+
+        return msg;
+    }
+
+    std::vector<TFramesPart> TRouterDRequest::OutgoingParts() {
+        std::vector<TFramesPart> out;
+
+        for (const auto& basePart : Out().Parts()) {
+            std::string contentDisposition;
+            NHTTP::THeaderParams params;
+            TFramesPart part;
+
+            NHTTPUtils::ParseHeader(basePart.Headers(), "content-disposition", contentDisposition, params);
+
+            if (params.count("name") > 0) {
+                NStringUtils::Strip(params.at("name"), part.Name, 2, "\"'");
+            }
+
+            part.Headers = basePart.Headers();
+            part.Content = basePart.Content();
+            part.ContentLength = basePart.ContentLength();
+
+            out.push_back(std::move(part));
+        }
+
+        return out;
+    }
+
+    TBlobSequence TRouterDRequest::OutgoingItemRequest(
+        const std::string& path,
+        const std::vector<std::string>& args,
+        const std::vector<TFramesPart>& parts,
+        const std::string& over,
+        size_t index,
+        const TFramesPart& item
+    ) {
+        const auto& base = Out();
+        NHTTP::TResponse out;
+
+        out.FirstLine(RewriteFirstLine(base.FirstLine(), path, args));
+
+        for (const auto& baseHeader : base.Headers()) {
+            AddHeader(baseHeader, out);
+        }
+
+        out.Header("X-AC-RouterD-Item", std::to_string(index));
+
+        for (const auto& basePart : parts) {
+            NHTTP::TResponse part;
+
+            if (basePart.ContentLength > 0) {
+                part.Wrap(basePart.ContentLength, basePart.Content);
+            }
+
+            for (const auto& baseHeader : basePart.Headers) {
+                AddHeader(baseHeader, part);
+            }
+
+            out.AddPart(std::move(part));
+        }
+
+        auto part = PreparePart(over);
+
+        for (const auto& header : item.Headers) {
+            if (
+                (header.first == std::string("content-type"))
+                || (header.first == std::string("content-disposition"))
+                || (header.first == std::string("content-length"))
+            ) {
+                continue;
+            }
+
+            AddHeader(header, part);
+        }
+
+        if (item.ContentLength > 0) {
+            part.Wrap(item.ContentLength, item.Content);
+        }
+
+        out.AddPart(std::move(part));
+
+        auto msg = (TBlobSequence)out;
+        msg.Memorize(PartHolders());
+
+        return msg;
+    }
+
+    TBlobSequence TRouterDRequest::OutgoingFrames(
+        const std::string& path,
+        const std::vector<std::string>& args,
+        const TServiceHostsGroup& group
+    ) {
+        const auto& base = Out();
+        TFramesWriter writer;
+        auto compressedBodies = std::make_shared<std::vector<std::shared_ptr<const std::string>>>();
+
+        for (const auto& basePart : base.Parts()) {
+            std::string contentDisposition;
+            std::string name;
+            NHTTP::THeaderParams params;
+
+            NHTTPUtils::ParseHeader(basePart.Headers(), "content-disposition", contentDisposition, params);
+
+            if (params.count("name") > 0) {
+                NStringUtils::Strip(params.at("name"), name, 2, "\"'");
+            }
+
+            std::shared_ptr<TSharedPayload> payload;
+            std::shared_ptr<const std::string> compressed;
+
+            if ((group.ShmThreshold > 0) && (basePart.ContentLength() >= group.ShmThreshold)) {
+                payload = SharedPayload(basePart.Content(), basePart.ContentLength());
+            }
+
+            if (!payload && group.Zstd && (basePart.ContentLength() >= group.CompressionMinSize) && (basePart.ContentLength() > 0)) {
+                compressed = CompressedBody(basePart.Content(), basePart.ContentLength(), group.CompressionLevel);
+            }
+
+            if (payload) {
+                auto headers = basePart.Headers();
+                headers["x-ac-routerd-shm"].push_back(payload->Path());
+                headers["x-ac-routerd-shm-length"].push_back(std::to_string(payload->Size()));
+
+                writer.AddPart(name, headers, nullptr, 0);
+
+            } else if (compressed) {
+                auto headers = basePart.Headers();
+                headers["x-ac-routerd-encoding"].push_back("zstd");
+
+                writer.AddPart(name, headers, compressed->data(), compressed->size());
+                compressedBodies->push_back(compressed);
+
+            } else {
+                writer.AddPart(name, basePart.Headers(), basePart.Content(), basePart.ContentLength());
+            }
+        }
+
+        const auto& frames = writer.Finish();
+
+        // NHTTP::TResponse holds a single wrapped body, so the message is assembled
+        // of the head and segments by hand: bodies are sent in place, only prefixes
+        // and headers are copied
+        auto head = std::make_shared<std::string>(RewriteFirstLine(base.FirstLine(), path, args));
+
+        while (!head->empty() && ((head->back() == '\n') || (head->back() == '\r'))) {
+            head->pop_back();
+        }
+
+        *head += "\r\n";
+
+        for (const auto& baseHeader : base.Headers()) {
+            if ((baseHeader.first == "content-type") || (baseHeader.first == "content-length")) {
+                continue;
+            }
+
+            for (const auto& value : baseHeader.second) {
+                *head += baseHeader.first + ": " + value + "\r\n";
+            }
+        }
+
+        *head += std::string("Content-Type: ") + FramesContentType + "\r\n";
+
+        if (group.Zstd) {
+            *head += "X-AC-RouterD-Accept-Encoding: zstd\r\n";
+        }
+
+        *head += "Content-Length: " + std::to_string(frames.Size) + "\r\n\r\n";
+
+        TBlobSequence msg;
+        msg.Concat(head->size(), head->data());
+
+        for (const auto& segment : frames.Segments) {
+            msg.Concat(segment.Size, segment.Data);
+        }
+
+        msg.Memorize(head);
+        msg.Memorize(frames.Meta);
+        msg.Memorize(MemoryUsage.Charge(head->size() + frames.Meta->size()));
+        msg.Memorize(PartHolders());
+        msg.Memorize(compressedBodies);
+
+        return msg;
+    }
+
+    TBlobSequence TRouterDRequest::PassthroughRequest(const std::string& path, const std::vector<std::string>& args) const {
+        NHTTP::TResponse out;
+        out.FirstLine(RewriteFirstLine(FirstLine(), path, args) + "\r\n");
+
+        const auto& hopByHopHeaders = HopByHopHeaders(Headers());
+
+        for (const auto& header : Headers()) {
+            if (
+                (hopByHopHeaders.count(header.first) > 0)
+                || (header.first == std::string("content-length"))
+                || (strncmp(header.first.data(), "x-ac-routerd", 12) == 0)
+            ) {
+                continue;
+            }
+
+            AddHeader(header, out);
+        }
+
+        out.Header("X-AC-RouterD-Method", Method());
+
+        if (ContentLength() > 0) {
+            out.Wrap(ContentLength(), Content());
+        }
+
         return (TBlobSequence)out;
     }
 }
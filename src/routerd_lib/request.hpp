@@ -5,8 +5,17 @@
 #include <utility>
 #include <json.hh>
 #include "structs.hpp"
+#include "memory.hpp"
+#include "shm.hpp"
+#include "frames.hpp"
 #include <unordered_set>
+#include <unordered_map>
+#include <map>
 #include <chrono>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <ac-common/spin_lock.hpp>
 #ifdef AC_DEBUG_ROUTERD_PROXY
 #include <iostream>
 #endif
@@ -16,6 +25,8 @@ namespace NAC {
     public:
         struct TArgs {
             bool AllowNestedRequests = false;
+            size_t MaxMemory = 0; // bytes per request, 0 for no limit
+            size_t MaxTotalMemory = 0; // bytes for all requests, 0 for no limit
 
             static TArgs FromConfig(const nlohmann::json&);
         };
@@ -27,6 +38,7 @@ namespace NAC {
             , Args(args)
             , StartTime_(std::chrono::steady_clock::now())
         {
+            BodyCharge = MemoryUsage.Charge(ContentLength());
         }
 
     protected:
@@ -35,18 +47,84 @@ namespace NAC {
 
     private:
         NHTTP::TResponse& Out();
+        std::shared_ptr<TSharedPayload> SharedPayload(const char* data, size_t size);
+
+        // Compressed once per request, null if compression does not pay off
+        std::shared_ptr<const std::string> CompressedBody(const char* data, size_t size, int level);
+
+        static std::string RewriteFirstLine(
+            const std::string& base,
+            const std::string& path,
+            const std::vector<std::string>& args
+        );
 
     public:
         NHTTP::TResponse PreparePart(const std::string& partName) const;
         void AddPart(NHTTP::TResponse&& part);
 
+        // Part of producer's reply, which points into memory owned by holder
+        void AddPart(
+            NHTTP::TResponse&& part,
+            const std::string& name,
+            const std::string& producer,
+            std::shared_ptr<void> holder
+        );
+
+        // Spilled bodies are passed via memfd as they are, without copying
+        void AddSharedPayloads(const std::vector<std::shared_ptr<TSharedPayload>>& payloads);
+
+        // Body which was received compressed is sent to services as it was received
+        void AddCompressedBody(const char* data, size_t size, std::shared_ptr<const std::string> compressed);
+
+        // Removes parts, which are not needed by anyone anymore, from the outgoing request.
+        // Parts of the original request are never removed.
+        void ReleaseParts(const std::function<bool(const std::string& name, const std::string& producer)>& isDead);
+
+        // Owns memory which outgoing request's parts point into,
+        // should be memorized by messages built of them
+        std::shared_ptr<void> PartHolders() const;
+
         virtual const std::string& DefaultChunkName() const {
             static const std::string defaultChunkName("default");
 
             return defaultChunkName;
         }
 
-        TBlobSequence OutgoingRequest(const std::string& path, const std::vector<std::string>& args);
+        // Parts of at least group.ShmThreshold bytes (if it's not zero) are passed via TSharedPayload,
+        // parts of at least group.CompressionMinSize bytes are compressed if group.Zstd is set
+        TBlobSequence OutgoingRequest(
+            const std::string& path,
+            const std::vector<std::string>& args,
+            const TServiceHostsGroup& group
+        );
+
+        TBlobSequence OutgoingFrames(
+            const std::string& path,
+            const std::vector<std::string>& args,
+            const TServiceHostsGroup& group
+        );
+
+        std::string OutgoingFirstLine(const std::string& path, const std::vector<std::string>& args) {
+            return RewriteFirstLine(Out().FirstLine(), path, args);
+        }
+
+        // Named parts of the outgoing request, bodies point into its envelope
+        std::vector<TFramesPart> OutgoingParts();
+
+        // Envelope for a single call of mapped service: parts of the 'over' dependency
+        // are replaced with the index-th item of it. Parts are passed by the caller,
+        // since dependencies could be released while items are still being sent.
+        TBlobSequence OutgoingItemRequest(
+            const std::string& path,
+            const std::vector<std::string>& args,
+            const std::vector<TFramesPart>& parts,
+            const std::string& over,
+            size_t index,
+            const TFramesPart& item
+        );
+
+        // Original request as is, for single-service graphs
+        TBlobSequence PassthroughRequest(const std::string& path, const std::vector<std::string>& args) const;
 
         void SetGraph(const TRouterDGraph& graph) {
             Graph = graph;
@@ -90,12 +168,101 @@ namespace NAC {
             return StartTime_;
         }
 
+        // Key of route cache entry which 'output' reply should be stored in
+        void SetRouteCacheKey(std::string&& key) {
+            RouteCacheKey_ = std::move(key);
+        }
+
+        const std::string& RouteCacheKey() const {
+            return RouteCacheKey_;
+        }
+
+        // Graph of the request could be advanced from threads of other requests,
+        // when they deliver replies of coalesced calls. Replies of upstreams are
+        // processed on threads of their clients rather than the request's one,
+        // so sending and calling services is already done from any thread of the
+        // server; the lock only serializes changes of the graph.
+        std::unique_lock<std::mutex> LockGraph() {
+            return std::unique_lock<std::mutex>(GraphLock);
+        }
+
+        // Callbacks to be run once graph lock is released
+        void Defer(std::function<void()>&& cb) {
+            Deferred.push_back(std::move(cb));
+        }
+
+        std::vector<std::function<void()>> TakeDeferred() {
+            return std::move(Deferred);
+        }
+
+        // Memory held on behalf of the request: reply of a service is charged
+        // until all parts which hold it are released
+        void AccountMemory(size_t size, const std::shared_ptr<void>& holder);
+
+        // Memory of a buffer, which is charged until the guard is released
+        std::shared_ptr<void> ChargeMemory(size_t size) {
+            return MemoryUsage.Charge(size);
+        }
+
+        bool IsOverMemoryBudget() const {
+            return ((Args.MaxMemory > 0) && (MemoryUsage.Get() > Args.MaxMemory));
+        }
+
+        bool IsOverTotalMemoryBudget() const {
+            return ((Args.MaxTotalMemory > 0) && (TMemoryUsage::Total() > Args.MaxTotalMemory));
+        }
+
+        // Stops the graph: no more services are called,
+        // and upstream connections which are still in flight are dropped.
+        // Called under graph lock: coalesced calls led by the request are failed once it's released.
+        void Cancel();
+
+        // Coalesced call, which is led by the request
+        void LeadCall(std::shared_ptr<TServiceCoalescer> coalescer, const std::string& key) {
+            LedCalls.emplace_back(std::move(coalescer), key);
+        }
+
+        bool IsCancelled() const {
+            return Cancelled.load();
+        }
+
+        // Upstream connection to be dropped on Cancel()
+        void AddUpstream(const std::shared_ptr<NHTTPServer::TClientBase>& client);
+
+    private:
+        struct TCompressedBody {
+            std::shared_ptr<const std::string> Received; // as sent by a service, fits any level
+            std::unordered_map<int, std::shared_ptr<const std::string>> ByLevel; // null if compression does not pay off
+        };
+
+        struct TPartInfo {
+            std::string Name;
+            std::string Producer; // empty for parts of the original request
+            std::shared_ptr<void> Holder;
+        };
+
     private:
         TArgs Args;
         bool OutgoingRequestInited = false;
         NHTTP::TResponse OutgoingRequest_;
+        std::vector<TPartInfo> PartInfos; // of OutgoingRequest_'s parts
         TRouterDGraph Graph;
         std::unordered_set<std::string> InProgress;
         std::chrono::steady_clock::time_point StartTime_;
+        std::string RouteCacheKey_;
+        TInFlightGuard InFlightGuard;
+        TMemoryUsage MemoryUsage;
+        std::shared_ptr<void> BodyCharge;
+        NUtils::TSpinLock ChargesLock;
+        std::unordered_map<const void*, std::vector<std::shared_ptr<void>>> Charges; // by holder of parts
+        std::map<std::pair<const char*, size_t>, std::shared_ptr<TSharedPayload>> SharedPayloads; // by body
+        std::vector<std::shared_ptr<TSharedPayload>> RetiredPayloads; // of released parts
+        std::map<std::pair<const char*, size_t>, TCompressedBody> CompressedBodies; // by body, while its part is not released
+        std::mutex GraphLock;
+        std::vector<std::function<void()>> Deferred;
+        std::atomic<bool> Cancelled = {false};
+        NUtils::TSpinLock UpstreamsLock;
+        std::vector<std::weak_ptr<NHTTPServer::TClientBase>> Upstreams;
+        std::vector<std::pair<std::shared_ptr<TServiceCoalescer>, std::string>> LedCalls;
     };
 }
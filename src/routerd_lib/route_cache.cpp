@@ -0,0 +1,284 @@
+#include "route_cache.hpp"
+#include "request.hpp"
+#include <ac-common/str.hpp>
+#include <ctype.h>
+#include <algorithm>
+
+namespace {
+    NAC::TCache<NAC::TRouteCache::TEntry>::TArgs StorageArgs(const NAC::TRouteCache::TArgs& args) {
+        NAC::TCache<NAC::TRouteCache::TEntry>::TArgs out;
+        out.MaxMemory = args.MaxMemory;
+
+        return out;
+    }
+
+    struct TCacheControl {
+        bool Cacheable = true;
+        bool HasMaxAge = false;
+        size_t MaxAge = 0; // seconds
+        bool HasStaleWhileRevalidate = false;
+        size_t StaleWhileRevalidate = 0; // seconds
+    };
+
+    TCacheControl ParseCacheControl(const std::string& value) {
+        TCacheControl out;
+        std::string token;
+        bool hasSMaxAge(false);
+
+        for (size_t i = 0; i <= value.size(); ++i) {
+            if ((i < value.size()) && (value[i] != ',')) {
+                if (!isspace(value[i])) {
+                    token += (char)tolower(value[i]);
+                }
+
+                continue;
+            }
+
+            const size_t eq(token.find('='));
+            const std::string name(token.substr(0, eq));
+            size_t arg(0);
+
+            if (eq != std::string::npos) {
+                std::string value_;
+                NAC::NStringUtils::Strip(token.substr(eq + 1), value_, 2, "\"'");
+                NAC::NStringUtils::FromString(value_, arg);
+            }
+
+            if ((name == "no-store") || (name == "no-cache") || (name == "private")) {
+                out.Cacheable = false;
+
+            } else if (name == "s-maxage") {
+                out.HasMaxAge = hasSMaxAge = true;
+                out.MaxAge = arg;
+
+            } else if ((name == "max-age") && !hasSMaxAge) {
+                out.HasMaxAge = true;
+                out.MaxAge = arg;
+
+            } else if (name == "stale-while-revalidate") {
+                out.HasStaleWhileRevalidate = true;
+                out.StaleWhileRevalidate = arg;
+            }
+
+            token.clear();
+        }
+
+        return out;
+    }
+
+    // Whether the reply varies only by headers which are a part of the key
+    bool VaryIsKeyed(const std::vector<std::string>& vary, const std::vector<std::string>& keyed) {
+        for (const auto& value : vary) {
+            std::string token;
+
+            for (size_t i = 0; i <= value.size(); ++i) {
+                if ((i < value.size()) && (value[i] != ',')) {
+                    if (!isspace(value[i])) {
+                        token += (char)tolower(value[i]);
+                    }
+
+                    continue;
+                }
+
+                if (!token.empty() && ((token == "*") || (std::find(keyed.begin(), keyed.end(), token) == keyed.end()))) {
+                    return false;
+                }
+
+                token.clear();
+            }
+        }
+
+        return true;
+    }
+}
+
+namespace NAC {
+    TRouteCache::TArgs TRouteCache::TArgs::FromConfig(const nlohmann::json& config) {
+        TArgs out;
+
+        out.Key.Normalize = true;
+
+        if (config.count("vary") > 0) {
+            for (auto header : config["vary"].get<std::vector<std::string>>()) {
+                for (auto&& c : header) {
+                    c = tolower(c);
+                }
+
+                out.Key.Headers.push_back(std::move(header));
+            }
+        }
+
+        if (config.count("normalize") > 0) {
+            out.Key.Normalize = config["normalize"].get<bool>();
+        }
+
+        if (config.count("ttl") > 0) {
+            out.TTL = config["ttl"].get<size_t>();
+        }
+
+        if (config.count("stale_while_revalidate") > 0) {
+            out.StaleWhileRevalidate = config["stale_while_revalidate"].get<size_t>();
+        }
+
+        if (config.count("max_memory") > 0) {
+            out.MaxMemory = config["max_memory"].get<size_t>();
+        }
+
+        if (config.count("persistent") > 0) {
+            out.Persistent = config["persistent"].get<bool>();
+        }
+
+        return out;
+    }
+
+    std::string TRouteCache::TEntry::Age() const {
+        size_t age(0);
+        NStringUtils::FromString(Part.HeaderValue("age"), age);
+
+        if (TClock::now() > Stored) {
+            age += std::chrono::duration_cast<std::chrono::seconds>(TClock::now() - Stored).count();
+        }
+
+        return std::to_string(age);
+    }
+
+    bool TRouteCache::TEntry::StartRevalidation() const {
+        const int64_t now(std::chrono::duration_cast<std::chrono::milliseconds>(TClock::now().time_since_epoch()).count());
+        int64_t after(RevalidateAfter.load());
+
+        if (now < after) {
+            return false;
+        }
+
+        // give up on revalidation if it did not finish in 10 seconds
+        return RevalidateAfter.compare_exchange_strong(after, now + 10000);
+    }
+
+    TRouteCache::TRouteCache(const TArgs& args)
+        : Args(args)
+        , Storage(StorageArgs(args))
+    {
+    }
+
+    std::string TRouteCache::Key(TRouterDRequest& request) const {
+        if ((request.Method() != std::string("get")) && (request.Method() != std::string("head"))) {
+            return std::string();
+        }
+
+        // credentials are not a part of the key, so a reply to one user could be served to another
+        if (!request.HeaderValue("authorization").empty()) {
+            bool vary(false);
+
+            for (const auto& header : Args.Key.Headers) {
+                if (header == "authorization") {
+                    vary = true;
+                    break;
+                }
+            }
+
+            if (!vary) {
+                return std::string();
+            }
+        }
+
+        return Args.Key.Build(request);
+    }
+
+    std::chrono::milliseconds TRouteCache::TTL(const TServiceReplyPart& part) const {
+        const auto& cacheControl = ParseCacheControl(part.HeaderValue("cache-control"));
+
+        return std::chrono::milliseconds(cacheControl.HasMaxAge ? (cacheControl.MaxAge * 1000) : Args.TTL);
+    }
+
+    std::shared_ptr<const TRouteCache::TEntry> TRouteCache::Get(const std::string& key) {
+        auto out = Storage.Get(key);
+
+        if (out || !Persistent) {
+            return out;
+        }
+
+        TPersistentCache::TClock::time_point expires;
+        uint64_t freshUntil;
+        auto reply = Persistent->Get(PersistentPrefix + key, &expires, &freshUntil);
+
+        if (!reply || reply->Parts.empty()) {
+            return out;
+        }
+
+        const auto& now = TPersistentCache::TClock::now();
+        auto entry = std::make_shared<TEntry>();
+        entry->Reply = reply;
+        entry->Part = reply->Parts.front().Part;
+        entry->ContentDispositionFormData = !reply->Multipart;
+        entry->FreshUntil = TClock::now() + (TPersistentCache::TClock::time_point(std::chrono::milliseconds(freshUntil)) - now);
+        entry->Stored = entry->FreshUntil - TTL(entry->Part); // lifetime is the same as it was when the entry was stored
+
+        Storage.Put(key, entry, reply->Size + key.size(), expires - now);
+
+        return entry;
+    }
+
+    void TRouteCache::Put(
+        const std::string& key,
+        std::shared_ptr<const TServiceReply> reply,
+        const TServiceReplyPart& part,
+        bool contentDispositionFormData
+    ) {
+        if ((reply->StatusCode < 200) || (reply->StatusCode >= 300)) {
+            return;
+        }
+
+        const auto& cacheControl = ParseCacheControl(part.HeaderValue("cache-control"));
+
+        if (!cacheControl.Cacheable) {
+            return;
+        }
+
+        // cookies are set for a particular user
+        if (part.Headers->count("set-cookie") > 0) {
+            return;
+        }
+
+        // reply could be served to requests it does not suit
+        const auto& vary = part.Headers->find("vary");
+
+        if ((vary != part.Headers->end()) && !VaryIsKeyed(vary->second, Args.Key.Headers)) {
+            return;
+        }
+
+        const auto& ttl = TTL(part);
+        const std::chrono::milliseconds stale(cacheControl.HasStaleWhileRevalidate
+            ? (cacheControl.StaleWhileRevalidate * 1000)
+            : Args.StaleWhileRevalidate);
+
+        if (ttl.count() == 0) {
+            return;
+        }
+
+        auto entry = std::make_shared<TEntry>();
+        entry->Reply = reply;
+        entry->Part = part;
+        entry->ContentDispositionFormData = contentDispositionFormData;
+        entry->Stored = TClock::now();
+        entry->FreshUntil = entry->Stored + ttl;
+
+        if (Persistent) {
+            // only the 'output' part is stored, multipart flag tells how to send it
+            TServiceReply persistentReply;
+            persistentReply.Holder = reply->Holder;
+            persistentReply.FirstLine = reply->FirstLine;
+            persistentReply.StatusCode = reply->StatusCode;
+            persistentReply.Multipart = !contentDispositionFormData;
+            persistentReply.AddPart(std::string(), part);
+
+            const auto& now = TPersistentCache::TClock::now();
+            const uint64_t freshUntil(std::chrono::duration_cast<std::chrono::milliseconds>((now + ttl).time_since_epoch()).count());
+
+            Persistent->Put(PersistentPrefix + key, persistentReply, now + ttl + stale, freshUntil);
+        }
+
+        const size_t size(reply->Size + key.size());
+
+        Storage.Put(key, std::move(entry), size, ttl + stale);
+    }
+}
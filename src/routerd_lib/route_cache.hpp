@@ -0,0 +1,83 @@
+#pragma once
+
+#include "cache.hpp"
+#include "key.hpp"
+#include "reply.hpp"
+#include "persistent_cache.hpp"
+#include <atomic>
+#include <json.hh>
+
+namespace NAC {
+    class TRouterDRequest;
+
+    // Caches final 'output' responses of a route, respecting Cache-Control.
+    class TRouteCache {
+    public:
+        using TClock = std::chrono::steady_clock;
+
+        struct TArgs {
+            TRequestKeySpec Key;
+            size_t TTL = 0; // ms, used if 'output' did not specify max-age
+            size_t StaleWhileRevalidate = 0; // ms, used if 'output' did not specify it
+            size_t MaxMemory = 64 * 1024 * 1024;
+            bool Persistent = false;
+
+            static TArgs FromConfig(const nlohmann::json&);
+        };
+
+        struct TEntry {
+            std::shared_ptr<const TServiceReply> Reply;
+            TServiceReplyPart Part;
+            bool ContentDispositionFormData = true;
+            TClock::time_point Stored;
+            TClock::time_point FreshUntil;
+            mutable std::atomic<int64_t> RevalidateAfter;
+
+            TEntry()
+                : RevalidateAfter(0)
+            {
+            }
+
+            bool IsFresh() const {
+                return (TClock::now() < FreshUntil);
+            }
+
+            // Value of Age header: seconds since the entry was stored, plus Age of the stored reply
+            std::string Age() const;
+
+            // Only one request at a time gets to revalidate stale entry
+            bool StartRevalidation() const;
+        };
+
+    public:
+        TRouteCache(const TArgs& args);
+
+        // Returns empty key if request could not be served from cache,
+        // including requests with Authorization, unless it's one of 'vary' headers
+        std::string Key(TRouterDRequest& request) const;
+
+        // Keys are prefixed with prefix in persistent cache, since it's shared
+        void SetPersistent(std::shared_ptr<TPersistentCache> persistent, const std::string& prefix) {
+            Persistent = persistent;
+            PersistentPrefix = prefix;
+        }
+
+        std::shared_ptr<const TEntry> Get(const std::string& key);
+
+        void Put(
+            const std::string& key,
+            std::shared_ptr<const TServiceReply> reply,
+            const TServiceReplyPart& part,
+            bool contentDispositionFormData
+        );
+
+    private:
+        std::chrono::milliseconds TTL(const TServiceReplyPart& part) const;
+
+    private:
+        TArgs Args;
+        TCache<TEntry> Storage;
+        std::shared_ptr<TPersistentCache> Persistent;
+        std::string PersistentPrefix;
+    };
+}
@@ -0,0 +1,71 @@
+#include "service_cache.hpp"
+
+namespace {
+    NAC::TCache<NAC::TServiceReply>::TArgs StorageArgs(const NAC::TServiceCache::TArgs& args) {
+        NAC::TCache<NAC::TServiceReply>::TArgs out;
+        out.MaxMemory = args.MaxMemory;
+
+        return out;
+    }
+}
+
+namespace NAC {
+    TServiceCache::TArgs TServiceCache::TArgs::FromConfig(const nlohmann::json& config) {
+        TArgs out;
+
+        if (config.count("key") > 0) {
+            out.Key = TRequestKeySpec::FromConfig(config["key"]);
+        }
+
+        if (config.count("ttl") > 0) {
+            out.TTL = config["ttl"].get<size_t>();
+        }
+
+        if (config.count("max_memory") > 0) {
+            out.MaxMemory = config["max_memory"].get<size_t>();
+        }
+
+        if (config.count("persistent") > 0) {
+            out.Persistent = config["persistent"].get<bool>();
+        }
+
+        return out;
+    }
+
+    TServiceCache::TServiceCache(const TArgs& args)
+        : Args(args)
+        , Storage(StorageArgs(args))
+    {
+    }
+
+    std::shared_ptr<const TServiceReply> TServiceCache::Get(const std::string& key) {
+        auto out = Storage.Get(key);
+
+        if (out || !Persistent) {
+            return out;
+        }
+
+        TPersistentCache::TClock::time_point expires;
+        out = Persistent->Get(PersistentPrefix + key, &expires);
+
+        if (out) {
+            Storage.Put(key, out, out->Size, expires - TPersistentCache::TClock::now());
+        }
+
+        return out;
+    }
+
+    void TServiceCache::Put(const std::string& key, std::shared_ptr<const TServiceReply> reply) {
+        if ((reply->StatusCode < 200) || (reply->StatusCode >= 300)) {
+            return;
+        }
+
+        const size_t size(reply->Size);
+
+        if (Persistent) {
+            Persistent->Put(PersistentPrefix + key, *reply, TPersistentCache::TClock::now() + std::chrono::milliseconds(Args.TTL));
+        }
+
+        Storage.Put(key, std::move(reply), size, std::chrono::milliseconds(Args.TTL));
+    }
+}
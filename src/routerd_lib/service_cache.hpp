@@ -0,0 +1,47 @@
+#pragma once
+
+#include "cache.hpp"
+#include "key.hpp"
+#include "reply.hpp"
+#include "persistent_cache.hpp"
+#include <json.hh>
+
+namespace NAC {
+    class TRouterDRequest;
+
+    class TServiceCache {
+    public:
+        struct TArgs {
+            TRequestKeySpec Key;
+            size_t TTL = 60000; // ms
+            size_t MaxMemory = 64 * 1024 * 1024;
+            bool Persistent = false;
+
+            static TArgs FromConfig(const nlohmann::json&);
+        };
+
+    public:
+        TServiceCache(const TArgs& args);
+
+        std::string Key(TRouterDRequest& request) const {
+            return Args.Key.Build(request);
+        }
+
+        // Keys are prefixed with prefix in persistent cache, since it's shared
+        void SetPersistent(std::shared_ptr<TPersistentCache> persistent, const std::string& prefix) {
+            Persistent = persistent;
+            PersistentPrefix = prefix;
+        }
+
+        std::shared_ptr<const TServiceReply> Get(const std::string& key);
+
+        // Only successful replies are stored
+        void Put(const std::string& key, std::shared_ptr<const TServiceReply> reply);
+
+    private:
+        TArgs Args;
+        TCache<TServiceReply> Storage;
+        std::shared_ptr<TPersistentCache> Persistent;
+        std::string PersistentPrefix;
+    };
+}
@@ -0,0 +1,72 @@
+#include "shm.hpp"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <iostream>
+
+namespace NAC {
+    std::shared_ptr<TSharedPayload> TSharedPayload::Create(const char* data, size_t size) {
+        const int fd(memfd_create("routerd-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+
+        if (fd < 0) {
+            std::cerr << "memfd_create() failed: " << strerror(errno) << std::endl;
+            return std::shared_ptr<TSharedPayload>();
+        }
+
+        std::shared_ptr<TSharedPayload> out(new TSharedPayload(fd, size));
+        size_t offset(0);
+
+        while (offset < size) {
+            const ssize_t written(write(fd, data + offset, size - offset));
+
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                std::cerr << "failed to write shared payload: " << strerror(errno) << std::endl;
+                return std::shared_ptr<TSharedPayload>();
+            }
+
+            offset += written;
+        }
+
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+            std::cerr << "failed to seal shared payload: " << strerror(errno) << std::endl;
+            return std::shared_ptr<TSharedPayload>();
+        }
+
+        return out;
+    }
+
+    TSharedPayload::~TSharedPayload() {
+        if (Data_) {
+            munmap((void*)Data_, Size_);
+        }
+
+        close(FD_);
+    }
+
+    bool TSharedPayload::Map() {
+        if (Data_) {
+            return true;
+        }
+
+        void* data = mmap(nullptr, Size_, PROT_READ, MAP_SHARED, FD_, 0);
+
+        if (data == MAP_FAILED) {
+            std::cerr << "failed to map shared payload: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        Data_ = (const char*)data;
+
+        return true;
+    }
+
+    std::string TSharedPayload::Path() const {
+        return "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(FD_);
+    }
+}
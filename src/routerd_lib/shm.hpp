@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <memory>
+
+namespace NAC {
+    // Immutable copy of a payload in a sealed memfd, which co-located
+    // processes could open via /proc/<routerd pid>/fd/<fd> and mmap.
+    class TSharedPayload {
+    public:
+        static std::shared_ptr<TSharedPayload> Create(const char* data, size_t size);
+
+        TSharedPayload(const TSharedPayload&) = delete;
+        TSharedPayload& operator=(const TSharedPayload&) = delete;
+        ~TSharedPayload();
+
+        int FD() const {
+            return FD_;
+        }
+
+        size_t Size() const {
+            return Size_;
+        }
+
+        std::string Path() const;
+
+        // Maps the payload read-only, so that it could be used in place of a heap buffer
+        bool Map();
+
+        const char* Data() const {
+            return Data_;
+        }
+
+    private:
+        TSharedPayload(int fd, size_t size)
+            : FD_(fd)
+            , Size_(size)
+        {
+        }
+
+    private:
+        int FD_;
+        size_t Size_;
+        const char* Data_ = nullptr;
+    };
+}
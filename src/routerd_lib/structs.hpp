@@ -3,20 +3,57 @@
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
+#include <memory>
 
 namespace NAC {
+    class TServiceCache;
+    class TServiceCoalescer;
+    class TServiceBatcher;
+
     struct TServiceHost {
         std::string Addr;
         unsigned short Port = 0;
         bool SSL = false;
     };
 
+    struct TServiceHostsGroup {
+        std::vector<TServiceHost> Hosts;
+        bool Frames = false; // send envelopes as application/x-ac-routerd-frames
+        size_t ShmThreshold = 0; // pass parts of at least that size via memfd, 0 to disable
+        size_t SpillThreshold = 0; // keep reply parts of at least that size in memfd, 0 to disable
+        bool Zstd = false; // compress parts sent to the group
+        int CompressionLevel = 1;
+        size_t CompressionMinSize = 1024; // smaller parts are sent as is
+        size_t MaxDecompressedSize = 64 * 1024 * 1024; // of a single part of reply
+    };
+
+    using TServiceHostsGroups = std::unordered_map<std::string, TServiceHostsGroup>;
+
+    struct TRaceAlternative {
+        std::string HostsFrom;
+        std::string Path;
+    };
+
+    // Options which Passthrough() does not support are rejected for 'passthrough' graphs in main.cpp
     struct TService {
         std::string Name;
         std::string HostsFrom;
         std::string Path;
         std::string SendRawOutputOf;
         std::string SaveAs;
+        std::vector<TRaceAlternative> Race; // called instead of HostsFrom, first successful reply wins
+        std::string MapOver; // called once per part of this dependency, or per element of its JSON array
+        size_t MapConcurrency = 0; // 0 for no limit
+        std::shared_ptr<TServiceCache> Cache; // shared between requests
+        std::shared_ptr<TServiceCoalescer> Coalescer; // shared between requests
+        std::shared_ptr<TServiceBatcher> Batcher; // shared between requests
+    };
+
+    // Dependency group, which is satisfied once K of its members have replied
+    struct TQuorum {
+        std::unordered_set<std::string> Members;
+        size_t K = 1;
     };
 
     struct TRouterDGraph {
@@ -25,5 +62,9 @@ namespace NAC {
         std::unordered_map<std::string, TService> Services;
         TTree Tree;
         TTree ReverseTree;
+        std::unordered_map<std::string, std::vector<TQuorum>> Quorums; // of dependent services, members are in Tree too
+        std::shared_ptr<const TTree> Dependents; // transitive, by service or part name; shared between requests
+        bool Passthrough = false; // forward original request to the only service, 'output'
+        size_t Timeout = 0; // ms, 504 is sent and the graph is cancelled after that, 0 to disable
     };
 }
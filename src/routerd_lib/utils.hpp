@@ -2,6 +2,8 @@
 
 #include <ac-library/http/response.hpp>
 #include <ac-library/http/utils/headers.hpp>
+#include <unordered_set>
+#include <ctype.h>
 
 namespace NAC {
     static inline void AddHeader(
@@ -45,6 +47,11 @@ namespace NAC {
                 continue;
             }
 
+            // control headers are meant for routerd only, they should not affect other services or reach the client
+            if ((header.first == "x-ac-routerd-skip") || (header.first == "x-ac-routerd-short-circuit")) {
+                continue;
+            }
+
             if (!contentType && (header.first == "content-type")) {
                 continue;
             }
@@ -72,4 +79,44 @@ namespace NAC {
 
         return false;
     }
+
+    // Headers which only make sense for the client's connection to routerd
+    // (RFC 7230, section 6.1), including the ones of HTTP/2 upgrade attempts,
+    // which routerd ignores.
+    static inline std::unordered_set<std::string> HopByHopHeaders(const NHTTPLikeParser::THeaders& headers) {
+        std::unordered_set<std::string> out {
+            "connection",
+            "keep-alive",
+            "proxy-connection",
+            "te",
+            "trailer",
+            "transfer-encoding",
+            "upgrade",
+            "http2-settings"
+        };
+
+        const auto& connection = headers.find("connection");
+
+        if (connection == headers.end()) {
+            return out;
+        }
+
+        for (const auto& value : connection->second) {
+            std::string token;
+
+            for (size_t i = 0; i <= value.size(); ++i) {
+                if ((i == value.size()) || (value[i] == ',')) {
+                    if (!token.empty()) {
+                        out.insert(token);
+                        token.clear();
+                    }
+
+                } else if (!isspace(value[i])) {
+                    token += (char)tolower(value[i]);
+                }
+            }
+        }
+
+        return out;
+    }
 }